@@ -16,28 +16,9 @@ enum sprites
 	sprite_explosion0, sprite_explosion1, sprite_explosion2,
 	sprite_tree, sprite_puddle, sprite_box, sprite_trap,
 
-	sprites_count
+	sprites_count,
+	sprites_rotated_count = sprite_car_destroy2 + 1
 };
-void load_textures(unique_ptr<texture_type>* textures, screen_type* screen)
-{
-	textures[sprite_main_car0] = new texture_type("sprites/main_car0.bmp", screen->renderer);
-	textures[sprite_main_car1] = new texture_type("sprites/main_car1.bmp", screen->renderer);
-	textures[sprite_trap_car0] = new texture_type("sprites/trap_car0.bmp", screen->renderer);
-	textures[sprite_trap_car1] = new texture_type("sprites/trap_car1.bmp", screen->renderer);
-	textures[sprite_tank_car] = new texture_type("sprites/tank_car.bmp", screen->renderer);
-	textures[sprite_regular_car] = new texture_type("sprites/regular_car.bmp", screen->renderer);
-	textures[sprite_car_destroy0] = new texture_type("sprites/car_destroy0.bmp", screen->renderer);
-	textures[sprite_car_destroy1] = new texture_type("sprites/car_destroy1.bmp", screen->renderer);
-	textures[sprite_car_destroy2] = new texture_type("sprites/car_destroy2.bmp", screen->renderer);
-	textures[sprite_explosion0] = new texture_type("sprites/explosion0.bmp", screen->renderer);
-	textures[sprite_explosion1] = new texture_type("sprites/explosion1.bmp", screen->renderer);
-	textures[sprite_explosion2] = new texture_type("sprites/explosion2.bmp", screen->renderer);
-	textures[sprite_tree] = new texture_type("sprites/tree.bmp", screen->renderer);
-	textures[sprite_puddle] = new texture_type("sprites/puddle.bmp", screen->renderer);
-	textures[sprite_box] = new texture_type("sprites/box.bmp", screen->renderer);
-	textures[sprite_trap] = new texture_type("sprites/trap.bmp", screen->renderer);
-}
-
 struct entity;
 
 enum entities
@@ -56,6 +37,20 @@ enum direction
 {
 	direction_up, direction_down, direction_left, direction_right
 };
+enum random_stream
+{
+	stream_road_size, stream_road_pos,
+	stream_tree, stream_tree_pos,
+	stream_puddle, stream_puddle_pos,
+	stream_box, stream_box_pos,
+	stream_car, stream_car_kind, stream_car_pos, stream_car_enemy
+};
+enum particle_kind
+{
+	particle_fire, particle_smoke, particle_debris,
+
+	particle_kinds_count
+};
 enum class game_state
 {
 	running, paused, score_points, score_time, finished, quit
@@ -64,9 +59,39 @@ enum class running_state
 {
 	normal, enter, slow, destroy
 };
+struct terrain_state
+{
+	float road_size_zeroth;
+	float road_size_first;
+	float road_pos_zeroth;
+	float road_pos_first;
+
+	int tree_cooldown;
+	int puddle_cooldown;
+	int box_cooldown;
+};
+struct generated_row
+{
+	terrain_state terrain;
+
+	bool tree, puddle, box;
+	float tree_x, puddle_x, box_x;
+};
+struct generated_chunk
+{
+	static constexpr int rows_count = 32;
+
+	long long first_row;
+	generated_row rows[rows_count];
+};
 struct game_data
 {
-	static constexpr const char save_file_prefix[] = "SpyHunterSaveFile";
+	static constexpr const char save_file_prefix[] = "SpyHunterSaveFile2";
+	static constexpr const char dump_file_prefix[] = "SpyHunterDump2";
+	static constexpr const char* asset_pack_file = "assets.pack";
+	static constexpr const char* scores_file = "scores.bin";
+	static constexpr const char* score_names_file = "scores.names";
+	static constexpr const char* legacy_scores_file = "scores.txt";
 
 	static constexpr int menu_bar_height = 32;
 	static constexpr int inner_menu_bar_height = 24;
@@ -79,8 +104,17 @@ struct game_data
 	static constexpr int road_max = 40;
 	static constexpr int grass_min_left = 8;
 
+	static constexpr float frame_rate = 60.f;
+	static constexpr float idle_frame_rate = 15.f;
+
+	static constexpr size_t update_grain = 64;
+
 	static constexpr int destroy_front = 64;
 	static constexpr int destroy_back = 16;
+	static constexpr int origin_chunk = 1024;
+
+	static constexpr int rotation_steps = 10;
+	static constexpr float rotation_step = 2.5f;
 
 	static constexpr float max_speed = 48.f;
 	static constexpr float acceleration = 8.f;
@@ -99,6 +133,10 @@ struct game_data
 	static constexpr float explosion_time = 0.3f;
 	static constexpr float trap_cooldown = 6.f;
 
+	static constexpr size_t particles_capacity = 8192;
+	static constexpr float particle_drag = 2.5f;
+	static constexpr int particle_shades = 8;
+
 	game_state state;
 	bool arrows[4];
 	bool shooting;
@@ -108,16 +146,11 @@ struct game_data
 	float car_state_left;
 	int lives;
 
+	long long origin;
 	int generation_pos;
 
-	float road_size_zeroth;
-	float road_size_first;
-	float road_pos_zeroth;
-	float road_pos_first;
+	terrain_state terrain;
 
-	int tree_cooldown;
-	int puddle_cooldown;
-	int box_cooldown;
 	int car_cooldown;
 	float bullet_cooldown;
 	int bazooka_left;
@@ -130,17 +163,373 @@ struct game_data
 
 	dynamic_array<unique_ptr<entity>> entities[entity_count];
 };
+static constexpr int particle_shades_count = particle_kinds_count * game_data::particle_shades;
 
-struct render_data_type
+struct view_transform
+{
+	void build(int width, int height, float camera_y, float zoom)
+	{
+		this->x_scale = (float)width / game_data::game_width;
+		this->x_offset = (float)(width / 2);
+		this->y_scale = (float)(height - 2 * game_data::menu_bar_height) / game_data::game_height;
+		this->y_offset = game_data::baseline_offset - camera_y * this->y_scale;
+		this->y_base = height - game_data::menu_bar_height;
+		this->size_scale = { (float)width / game_data::game_width, (float)height / game_data::game_height };
+
+		point anchor = { width / 2, height - game_data::menu_bar_height - game_data::baseline_offset };
+		this->zoom = zoom;
+		this->zoom_offset = { (int)roundf(anchor.x / zoom - anchor.x), (int)roundf(anchor.y / zoom - anchor.y) };
+	}
+
+	point to_layout(coord c) const
+	{
+		return { (int)(this->x_offset + c.x * this->x_scale), this->y_base - (int)(this->y_offset + c.y * this->y_scale) };
+	}
+	point to_screen(coord c) const
+	{
+		point p = this->to_layout(c);
+		return { p.x + this->zoom_offset.x, p.y + this->zoom_offset.y };
+	}
+	point to_size(coord size) const
+	{
+		return { (int)(size.x * this->size_scale.x), (int)(size.y * this->size_scale.y) };
+	}
+
+	void transform(const coord* in, point* out, size_t count) const
+	{
+		size_t i = 0;
+
+#if defined(SIMD_AVX2)
+		__m256 scale = _mm256_setr_ps(this->x_scale, this->y_scale, this->x_scale, this->y_scale, 
+									  this->x_scale, this->y_scale, this->x_scale, this->y_scale);
+		__m256 offset = _mm256_setr_ps(this->x_offset, this->y_offset, this->x_offset, this->y_offset, 
+									   this->x_offset, this->y_offset, this->x_offset, this->y_offset);
+		__m256i negate = _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+		int y_base = this->y_base + this->zoom_offset.y;
+		__m256i base = _mm256_setr_epi32(this->zoom_offset.x, y_base, this->zoom_offset.x, y_base, 
+										 this->zoom_offset.x, y_base, this->zoom_offset.x, y_base);
+		for (; i + 4 <= count; i += 4) {
+			__m256i v = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&in[i].x), scale), offset));
+			v = _mm256_sub_epi32(_mm256_xor_si256(v, negate), negate);
+			_mm256_storeu_si256((__m256i*)&out[i], _mm256_add_epi32(v, base));
+		}
+#elif defined(SIMD_SSE2)
+		__m128 scale = _mm_setr_ps(this->x_scale, this->y_scale, this->x_scale, this->y_scale);
+		__m128 offset = _mm_setr_ps(this->x_offset, this->y_offset, this->x_offset, this->y_offset);
+		__m128i negate = _mm_setr_epi32(0, -1, 0, -1);
+		__m128i base = _mm_setr_epi32(this->zoom_offset.x, this->y_base + this->zoom_offset.y, 
+									  this->zoom_offset.x, this->y_base + this->zoom_offset.y);
+		for (; i + 2 <= count; i += 2) {
+			__m128i v = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&in[i].x), scale), offset));
+			v = _mm_sub_epi32(_mm_xor_si128(v, negate), negate);
+			_mm_storeu_si128((__m128i*)&out[i], _mm_add_epi32(v, base));
+		}
+#endif
+
+		for (; i < count; i++)
+			out[i] = this->to_screen(in[i]);
+	}
+
+	float x_scale, x_offset;
+	float y_scale, y_offset;
+	int y_base;
+	coord size_scale;
+	float zoom;
+	point zoom_offset;
+};
+
+class camera
+{
+public:
+	void update(float target_y, long long origin)
+	{
+		Uint32 now = SDL_GetTicks();
+		float delta = this->last_ticks_ ? (now - this->last_ticks_) / 1000.f : 0.f;
+		this->last_ticks_ = now;
+
+		if (!this->initialized_) {
+			this->y_ = target_y;
+			this->origin_ = origin;
+			this->initialized_ = true;
+		}
+		this->y_ += (float)(this->origin_ - origin);
+		this->origin_ = origin;
+
+		float followed = this->y_ + (target_y - this->y_) * (1.f - expf(-follow_rate * delta));
+		this->y_ = target_y - clamp(target_y - followed, -max_lag, max_lag);
+		this->zoom_ += (this->target_zoom_ - this->zoom_) * (1.f - expf(-zoom_rate * delta));
+	}
+
+	void zoom_in()
+	{
+		this->target_zoom_ = min(this->target_zoom_ + zoom_step, max_zoom);
+	}
+	void zoom_out()
+	{
+		this->target_zoom_ = max(this->target_zoom_ - zoom_step, 1.f);
+	}
+
+	float y() const noexcept
+	{
+		return this->y_;
+	}
+	float zoom() const noexcept
+	{
+		return this->zoom_;
+	}
+
+private:
+	static constexpr float follow_rate = 20.f;
+	static constexpr float max_lag = 2.f;
+	static constexpr float zoom_rate = 8.f;
+	static constexpr float zoom_step = 0.25f;
+	static constexpr float max_zoom = 2.f;
+
+	float y_ = 0.f;
+	long long origin_ = 0;
+	float zoom_ = 1.f;
+	float target_zoom_ = 1.f;
+	Uint32 last_ticks_ = 0;
+	bool initialized_ = false;
+};
+
+enum render_command_type
+{
+	render_command_rect, render_command_sprite, render_command_rotated_sprite,
+
+	render_command_types_count
+};
+struct render_command
+{
+	render_command_type type;
+	int layer;
+	sprites sprite;
+	color c;
+	point pos;
+	point size;
+	float angle;
+};
+struct background_strip
+{
+	long long row;
+	int x, width;
+};
+struct background_tree
+{
+	long long row;
+	int x;
+};
+struct render_frame
 {
-	screen_type* screen;
-	game_data* game;
-	font_type* font;
-	unique_ptr<texture_type> textures[sprites_count];
+	void add_strip(long long row, coord pos, float width)
+	{
+		this->strips.add({ row, this->view.to_layout(pos).x, this->view.to_size({ width, 0.f }).x });
+	}
+	void add_tree(long long row, coord pos)
+	{
+		this->trees.add({ row, this->view.to_layout(pos).x });
+	}
+	void add_rect(coord pos, coord size, color c)
+	{
+		this->commands.add({ render_command_rect, this->layer, sprites_count, c, {}, this->view.to_size(size), 0.f });
+		this->positions.add(pos);
+	}
+	void add_sprite(sprites sprite, coord center, float angle = 0.f)
+	{
+		this->commands.add({ angle != 0.f ? render_command_rotated_sprite : render_command_sprite, 
+							 this->layer, sprite, color::white(), {}, {}, angle });
+		this->positions.add(center);
+	}
+	void add_particle(coord center, float size, int shade)
+	{
+		this->particle_centers.add(center);
+		this->particle_shapes.add({ this->view.to_size({ size, size }), shade });
+	}
+
+	void clear()
+	{
+		this->commands.clear();
+		this->positions.clear();
+		this->strips.clear();
+		this->trees.clear();
+		this->particle_centers.clear();
+		this->particle_shapes.clear();
+	}
+	void transform_commands()
+	{
+		this->points.resize(this->positions.size());
+		this->view.transform(this->positions.begin(), this->points.begin(), this->positions.size());
+		for (size_t i = 0; i < this->commands.size(); i++)
+			this->commands[i].pos = this->points[i];
+	}
+	void transform_particles()
+	{
+		size_t count = this->particle_centers.size();
+		this->points.resize(count);
+		this->view.transform(this->particle_centers.begin(), this->points.begin(), count);
+
+		size_t offsets[particle_shades_count + 1] = {};
+		for (const particle_shape& shape : this->particle_shapes)
+			offsets[shape.shade + 1]++;
+		for (int i = 0; i < particle_shades_count; i++)
+			offsets[i + 1] += offsets[i];
+		memcpy(this->particle_offsets, offsets, sizeof(offsets));
+
+		this->particles.resize(count);
+		for (size_t i = 0; i < count; i++) {
+			const particle_shape& shape = this->particle_shapes[i];
+			this->particles[offsets[shape.shade]++] = { this->points[i].x - shape.size.x / 2, this->points[i].y - shape.size.y / 2,
+														shape.size.x, shape.size.y };
+		}
+	}
+
+	void sort_commands()
+	{
+		static constexpr int keys_count = entity_count * 2;
+
+		size_t offsets[keys_count + 1] = {};
+		for (const render_command& command : this->commands)
+			offsets[sort_key(command) + 1]++;
+		for (int i = 0; i < keys_count; i++)
+			offsets[i + 1] += offsets[i];
+
+		this->sorted.resize(this->commands.size());
+		for (const render_command& command : this->commands)
+			this->sorted[offsets[sort_key(command)]++] = command;
+
+		dynamic_array<render_command> commands = move(this->commands);
+		this->commands = move(this->sorted);
+		this->sorted = move(commands);
+	}
+
+	void save(FILE* file) const
+	{
+		fwrite(&this->width, sizeof(this->width), 1, file);
+		fwrite(&this->height, sizeof(this->height), 1, file);
+		fwrite(&this->camera_y, sizeof(this->camera_y), 1, file);
+		fwrite(&this->view, sizeof(this->view), 1, file);
+		fwrite(&this->origin, sizeof(this->origin), 1, file);
+		fwrite(&this->random_seed, sizeof(this->random_seed), 1, file);
+		fwrite(&this->state, sizeof(this->state), 1, file);
+		fwrite(&this->lives, sizeof(this->lives), 1, file);
+		fwrite(&this->score, sizeof(this->score), 1, file);
+		fwrite(&this->elapsed_time, sizeof(this->elapsed_time), 1, file);
+
+		save_array(file, this->commands);
+		save_array(file, this->strips);
+		save_array(file, this->trees);
+		save_array(file, this->particles);
+		fwrite(this->particle_offsets, sizeof(this->particle_offsets), 1, file);
+	}
+	bool load(FILE* file)
+	{
+		if (fread(&this->width, sizeof(this->width), 1, file) != 1)
+			return false;
+		fread(&this->height, sizeof(this->height), 1, file);
+		fread(&this->camera_y, sizeof(this->camera_y), 1, file);
+		fread(&this->view, sizeof(this->view), 1, file);
+		fread(&this->origin, sizeof(this->origin), 1, file);
+		fread(&this->random_seed, sizeof(this->random_seed), 1, file);
+		fread(&this->state, sizeof(this->state), 1, file);
+		fread(&this->lives, sizeof(this->lives), 1, file);
+		fread(&this->score, sizeof(this->score), 1, file);
+		fread(&this->elapsed_time, sizeof(this->elapsed_time), 1, file);
+
+		if (!load_array(file, &this->commands) || !load_array(file, &this->strips) || !load_array(file, &this->trees) ||
+			!load_array(file, &this->particles) || fread(this->particle_offsets, sizeof(this->particle_offsets), 1, file) != 1)
+			return false;
+		if (this->width <= 0 || this->width > max_size || this->height <= 0 || this->height > max_size) {
+			printf("Invalid frame size %dx%d in dump.\n", this->width, this->height);
+			return false;
+		}
+		for (const render_command& command : this->commands) {
+			if (command.type < 0 || command.type >= render_command_types_count || command.layer < 0 || command.layer >= entity_count ||
+				(command.type != render_command_rect && (command.sprite < 0 || command.sprite >= sprites_count))) {
+				printf("Invalid command in dump.\n");
+				return false;
+			}
+		}
+		bool offsets_valid = this->particle_offsets[0] == 0 && this->particle_offsets[particle_shades_count] <= this->particles.size();
+		for (int i = 0; i < particle_shades_count; i++)
+			offsets_valid = offsets_valid && this->particle_offsets[i] <= this->particle_offsets[i + 1];
+		if (!offsets_valid) {
+			printf("Invalid particle offsets in dump.\n");
+			return false;
+		}
+		return true;
+	}
+	static void save_header(FILE* file)
+	{
+		fwrite(game_data::dump_file_prefix, sizeof(game_data::dump_file_prefix), 1, file);
+	}
+	static bool load_header(FILE* file)
+	{
+		char text_check[sizeof(game_data::dump_file_prefix)] = {};
+		return fread(text_check, sizeof(text_check), 1, file) == 1 &&
+			   memcmp(text_check, game_data::dump_file_prefix, sizeof(game_data::dump_file_prefix)) == 0;
+	}
+
+	int width, height;
+	float camera_y;
+	view_transform view;
+	long long origin;
+	unsigned long long random_seed;
+
+	game_state state;
+	int lives;
+	long score;
+	long elapsed_time;
+
+	int layer = 0;
+	dynamic_array<render_command> commands;
+	dynamic_array<background_strip> strips;
+	dynamic_array<background_tree> trees;
+	dynamic_array<SDL_Rect> particles;
+	size_t particle_offsets[particle_shades_count + 1] = {};
+
+private:
+	struct particle_shape
+	{
+		point size;
+		int shade;
+	};
+
+	template<typename Type>
+	static void save_array(FILE* file, const dynamic_array<Type>& array)
+	{
+		size_t count = array.size();
+		fwrite(&count, sizeof(count), 1, file);
+		fwrite(array.begin(), sizeof(Type), count, file);
+	}
+	static int sort_key(const render_command& command)
+	{
+		return command.layer * 2 + (command.type == render_command_rect ? 0 : 1);
+	}
+
+	static constexpr int max_size = 16384;
+	static constexpr size_t max_array_count = 1 << 20;
+
+	template<typename Type>
+	static bool load_array(FILE* file, dynamic_array<Type>* array)
+	{
+		size_t count;
+		if (fread(&count, sizeof(count), 1, file) != 1)
+			return false;
+		if (count > max_array_count) {
+			printf("Invalid array size %zu in dump.\n", count);
+			return false;
+		}
+		array->resize(count);
+		return fread(array->begin(), sizeof(Type), count, file) == count;
+	}
+
+	dynamic_array<render_command> sorted;
+	dynamic_array<coord> positions;
+	dynamic_array<point> points;
+	dynamic_array<coord> particle_centers;
+	dynamic_array<particle_shape> particle_shapes;
 };
 
-point coord_to_point(const render_data_type& render_data, coord val);
-point game_to_screen(const render_data_type& render_data, coord size);
 
 struct entity
 {
@@ -148,7 +537,7 @@ struct entity
 	virtual ~entity() noexcept = default;
 
 	virtual void update(float delta) {}
-	virtual void render(const render_data_type& render_data) = 0;
+	virtual void render(render_frame& frame) const = 0;
 
 	entity(FILE* file)
 	{
@@ -201,7 +590,7 @@ struct hitbox_check : public entity
 		}
 	}
 
-	void render(const render_data_type& render_data) override {}
+	void render(render_frame& frame) const override {}
 };
 struct grass : public entity
 {
@@ -228,10 +617,9 @@ struct grass : public entity
 		this->hitbox_size = this->size;
 	}
 
-	void render(const render_data_type& render_data) override
+	void render(render_frame& frame) const override
 	{
-		draw_rect(render_data.screen, coord_to_point(render_data, this->position), 
-				  game_to_screen(render_data, this->size), color::green());
+		frame.add_strip(frame.origin + (long long)this->position.y, this->position, this->size.x);
 	}
 
 	grass(FILE* file)
@@ -254,10 +642,9 @@ struct tree : public entity
 		this->position = position;
 	}
 
-	void render(const render_data_type& render_data) override
+	void render(render_frame& frame) const override
 	{
-		draw_texture(render_data.screen, render_data.textures[sprite_tree].get(),
-					 coord_to_point(render_data, this->position));
+		frame.add_tree(frame.origin + (long long)this->position.y, this->position);
 	}
 
 	tree(FILE* file)
@@ -274,10 +661,9 @@ struct puddle : public entity
 		this->hitbox_rel_pos = { -this->hitbox_size.x / 2.f, -this->hitbox_size.y / 2.f };
 	}
 
-	void render(const render_data_type& render_data) override
+	void render(render_frame& frame) const override
 	{
-		draw_texture(render_data.screen, render_data.textures[sprite_puddle].get(),
-					 coord_to_point(render_data, this->position));
+		frame.add_sprite(sprite_puddle, this->position);
 	}
 
 	puddle(FILE* file)
@@ -294,10 +680,9 @@ struct trap : public entity
 		this->hitbox_rel_pos = { -this->hitbox_size.x / 2.f, -this->hitbox_size.y / 2.f };
 	}
 
-	void render(const render_data_type& render_data) override
+	void render(render_frame& frame) const override
 	{
-		draw_texture(render_data.screen, render_data.textures[sprite_trap].get(),
-					 coord_to_point(render_data, this->position));
+		frame.add_sprite(sprite_trap, this->position);
 	}
 
 	trap(FILE* file)
@@ -314,10 +699,9 @@ struct box : public entity
 		this->hitbox_rel_pos = { -this->hitbox_size.x / 2.f, -this->hitbox_size.y / 2.f };
 	}
 
-	void render(const render_data_type& render_data) override
+	void render(render_frame& frame) const override
 	{
-		draw_texture(render_data.screen, render_data.textures[sprite_box].get(),
-					 coord_to_point(render_data, this->position));
+		frame.add_sprite(sprite_box, this->position);
 	}
 
 	box(FILE* file)
@@ -345,12 +729,11 @@ struct bullet : public entity
 			this->lifetime -= delta;
 		}
 	}
-	void render(const render_data_type& render_data) override
+	void render(render_frame& frame) const override
 	{
 		if(this->lifetime > 0.f)
-			draw_rect(render_data.screen, coord_to_point(render_data, { this->position.x + this->hitbox_rel_pos.x, 
-														 this->position.y + this->hitbox_rel_pos.y }),
-					  game_to_screen(render_data, this->hitbox_size), color::gray());
+			frame.add_rect({ this->position.x + this->hitbox_rel_pos.x, this->position.y + this->hitbox_rel_pos.y },
+						   this->hitbox_size, color::gray());
 	}
 
 	bullet(FILE* file)
@@ -388,15 +771,14 @@ struct explosion : public entity
 	{
 		this->lifetime -= delta;
 	}
-	void render(const render_data_type& render_data) override
+	void render(render_frame& frame) const override
 	{
 		if (this->lifetime > 0.f) {
 			sprites anim = sprites(sprite_explosion0 + (int)(3 * this->lifetime / this->max_lifetime));
 			if (anim > sprite_explosion2)
 				anim = sprite_explosion2;
 
-			draw_texture(render_data.screen, render_data.textures[anim].get(),
-						 coord_to_point(render_data, this->position));
+			frame.add_sprite(anim, this->position);
 		}
 	}
 
@@ -450,16 +832,15 @@ struct car : public entity
 		while (this->anim_time >= this->anim_restart_time)
 			this->anim_time -= this->anim_restart_time;
 	}
-	void render(const render_data_type& render_data) override
+	void render(render_frame& frame) const override
 	{
 		if (this->animation.size() == 0)
 			return;
 
 		int index = (int)(this->anim_time * this->animation.size() / this->anim_restart_time);
 
-		draw_texture(render_data.screen, render_data.textures[this->animation[index]].get(),
-					 coord_to_point(render_data, { this->position.x + this->render_position_offset.x, 
-									this->position.y + this->render_position_offset.y }), this->move_angle);
+		frame.add_sprite(this->animation[index], { this->position.x + this->render_position_offset.x, 
+												   this->position.y + this->render_position_offset.y }, this->move_angle);
 	}
 
 	void destroy()
@@ -527,118 +908,945 @@ struct car : public entity
 	bool destroyed = false;
 };
 
-point coord_to_point(const render_data_type& render_data, coord val)
+struct score_type
+{
+	score_type() = default;
+
+	score_type(const score_type&) = delete;
+	score_type& operator=(const score_type&) = delete;
+
+	score_type(score_type&& other) noexcept
+	{
+		this->name = other.name;
+		other.name = NULL;
+		this->score = other.score;
+		this->elapsed_time = other.elapsed_time;
+	}
+	score_type& operator=(score_type&& other) noexcept
+	{
+		if (this->name)
+			free(this->name);
+		this->name = other.name;
+		other.name = NULL;
+		this->score = other.score;
+		this->elapsed_time = other.elapsed_time;
+		return *this;
+	}
+
+	~score_type()
+	{
+		if (this->name)
+			free(this->name);
+	}
+
+	char* name = NULL;
+	long score;
+	long elapsed_time;
+};
+
+enum score_order
+{
+	score_order_points, score_order_time,
+
+	score_orders_count
+};
+struct score_record
+{
+	Sint32 score;
+	Sint32 elapsed_time;
+	Uint32 name;
+};
+
+class score_store
+{
+public:
+	static constexpr char records_magic[8] = "SHSCOR1";
+	static constexpr char names_magic[8] = "SHNAME1";
+	static constexpr size_t max_name_length = 255;
+
+	score_store() = default;
+
+	score_store(const score_store&) = delete;
+	score_store& operator=(const score_store&) = delete;
+
+	bool open(const char* records_path, const char* names_path)
+	{
+		this->records_path_ = records_path;
+		this->names_path_ = names_path;
+
+		FILE* names = NULL;
+		FILE* records = NULL;
+		fopen_s(&names, names_path, "rb");
+		fopen_s(&records, records_path, "rb");
+		if (!names && !records)
+			return false;
+
+		char magic[sizeof(names_magic)];
+		bool names_valid = names && fread(magic, sizeof(magic), 1, names) == 1 && memcmp(magic, names_magic, sizeof(magic)) == 0;
+		Uint16 length;
+		char name[max_name_length];
+		while (names_valid && fread(&length, sizeof(length), 1, names) == 1) {
+			if (length > max_name_length || fread(name, 1, length, names) != length) {
+				names_valid = false;
+				break;
+			}
+			this->add_name(name, length);
+		}
+
+		bool valid = names_valid;
+		bool records_valid = records && fread(magic, sizeof(magic), 1, records) == 1 && memcmp(magic, records_magic, sizeof(magic)) == 0;
+		score_record record;
+		size_t bytes = 0;
+		while (records_valid && (bytes = fread(&record, 1, sizeof(record), records)) == sizeof(record)) {
+			if (record.name < this->name_offsets_.size())
+				this->records_.add(record);
+			else
+				valid = false;
+		}
+		valid = valid && records_valid && bytes == 0;
+
+		if (records)
+			fclose(records);
+		if (names)
+			fclose(names);
+
+		this->rebuild_indexes();
+		if (!valid) {
+			printf("Score store %s is damaged, loaded %zu scores.\n", records_path, this->records_.size());
+			keep_damaged(names_path);
+			keep_damaged(records_path);
+			this->save();
+		}
+		return true;
+	}
+
+	int import_text(const char* path)
+	{
+		FILE* file;
+		if (fopen_s(&file, path, "rb") != 0)
+			return 0;
+		fseek(file, 0, SEEK_END);
+		long length = ftell(file);
+		char* buffer = (char*)malloc(length + 1);
+		fseek(file, 0, SEEK_SET);
+		fread(buffer, 1, length, file);
+		buffer[length] = NULL;
+		fclose(file);
+
+		int imported = 0;
+		for (char* it = buffer, *end = buffer + length; it < end;) {
+			char* newline = strchr(it, '\n');
+			char* line_end = newline ? newline : end;
+			*line_end = NULL;
+
+			long score, elapsed_time;
+			int read_count;
+			if (sscanf_s(it, "%li %li%n", &score, &elapsed_time, &read_count) == 2 && it + read_count <= line_end) {
+				if (it + read_count < line_end)
+					read_count++;
+				size_t name_length = line_end - it - read_count;
+				if (name_length != 0 && it[read_count + name_length - 1] == '\r')
+					name_length--;
+				this->records_.add({ (Sint32)score, (Sint32)elapsed_time, this->intern(it + read_count, name_length) });
+				imported++;
+			}
+			it = line_end + 1;
+		}
+		free(buffer);
+
+		this->rebuild_indexes();
+		this->save();
+		return imported;
+	}
+
+	void add(long score, long elapsed_time, const char* name)
+	{
+		size_t names_count = this->name_offsets_.size();
+		score_record record = { (Sint32)score, (Sint32)elapsed_time, this->intern(name, strlen(name)) };
+
+		if (this->name_offsets_.size() != names_count)
+			if (FILE* names = open_append(this->names_path_, names_magic)) {
+				write_name(names, this->name(record.name));
+				fclose(names);
+			}
+		if (FILE* records = open_append(this->records_path_, records_magic)) {
+			fwrite(&record, sizeof(record), 1, records);
+			fclose(records);
+		}
+
+		Uint32 id = (Uint32)this->records_.size();
+		this->records_.add(record);
+		this->priorities_.add(random_uint(priority_key, id));
+		for (int order = 0; order < score_orders_count; order++) {
+			this->trees_[order].add({ no_node, no_node, 1 });
+			Uint32 left, right;
+			this->split(order, this->roots_[order], record, &left, &right);
+			this->roots_[order] = this->merge(order, this->merge(order, left, id), right);
+		}
+	}
+
+	size_t rank(score_order order, long score, long elapsed_time) const
+	{
+		score_record record = { (Sint32)score, (Sint32)elapsed_time, 0 };
+		const dynamic_array<rank_node>& tree = this->trees_[order];
+		size_t rank = 1;
+		for (Uint32 node = this->roots_[order]; node != no_node;)
+			if (better(order, record, this->records_[node]))
+				node = tree[node].left;
+			else {
+				rank += this->subtree_size(order, tree[node].left) + 1;
+				node = tree[node].right;
+			}
+		return rank;
+	}
+
+	size_t size() const noexcept
+	{
+		return this->records_.size();
+	}
+	size_t top(score_order order, Uint32* ids, size_t count) const
+	{
+		const dynamic_array<rank_node>& tree = this->trees_[order];
+		dynamic_array<Uint32> path;
+		size_t written = 0;
+		Uint32 node = this->roots_[order];
+		while (written < count && (node != no_node || path.size() != 0)) {
+			if (node != no_node) {
+				path.add(node);
+				node = tree[node].left;
+				continue;
+			}
+			node = path[path.size() - 1];
+			path.resize(path.size() - 1);
+			ids[written++] = node;
+			node = tree[node].right;
+		}
+		return written;
+	}
+	const score_record& record(Uint32 id) const noexcept
+	{
+		return this->records_[id];
+	}
+	const char* name(Uint32 id) const noexcept
+	{
+		return this->name_data_.begin() + this->name_offsets_[id];
+	}
+
+private:
+	static bool better(int order, const score_record& a, const score_record& b) noexcept
+	{
+		return order == score_order_points ? a.score > b.score : a.elapsed_time > b.elapsed_time;
+	}
+	static unsigned hash_name(const char* name, size_t length) noexcept
+	{
+		unsigned hash = 2166136261u;
+		for (size_t i = 0; i < length; i++)
+			hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+		return hash;
+	}
+
+	static FILE* open_append(const char* path, const char (&magic)[sizeof(records_magic)])
+	{
+		FILE* file;
+		if (fopen_s(&file, path, "ab") != 0)
+			return NULL;
+		fseek(file, 0, SEEK_END);
+		if (ftell(file) == 0)
+			fwrite(magic, sizeof(magic), 1, file);
+		return file;
+	}
+	static void keep_damaged(const char* path)
+	{
+		char backup[260];
+		sprintf_s(backup, sizeof(backup), "%s.damaged", path);
+		remove(backup);
+		if (rename(path, backup) == 0)
+			printf("Kept a copy of %s as %s.\n", path, backup);
+	}
+	static void write_name(FILE* file, const char* name)
+	{
+		Uint16 length = (Uint16)strlen(name);
+		fwrite(&length, sizeof(length), 1, file);
+		fwrite(name, 1, length, file);
+	}
+
+	void save()
+	{
+		FILE* file;
+		if (fopen_s(&file, this->names_path_, "wb") == 0) {
+			fwrite(names_magic, sizeof(names_magic), 1, file);
+			for (size_t i = 0; i < this->name_offsets_.size(); i++)
+				write_name(file, this->name((Uint32)i));
+			fclose(file);
+		}
+		if (fopen_s(&file, this->records_path_, "wb") == 0) {
+			fwrite(records_magic, sizeof(records_magic), 1, file);
+			fwrite(this->records_.begin(), sizeof(score_record), this->records_.size(), file);
+			fclose(file);
+		}
+	}
+
+	Uint32 add_name(const char* name, size_t length)
+	{
+		if ((this->name_offsets_.size() + 1) * 2 > this->slots_.size()) {
+			dynamic_array<Uint32> slots(max(this->slots_.size() * 2, (size_t)64));
+			memset(slots.begin(), 0, slots.size() * sizeof(Uint32));
+			for (Uint32 i = 0; i < this->name_offsets_.size(); i++) {
+				const char* existing = this->name(i);
+				size_t slot = hash_name(existing, strlen(existing)) & (slots.size() - 1);
+				while (slots[slot] != 0)
+					slot = (slot + 1) & (slots.size() - 1);
+				slots[slot] = i + 1;
+			}
+			this->slots_ = move(slots);
+		}
+
+		Uint32 id = (Uint32)this->name_offsets_.size();
+		this->name_offsets_.add((Uint32)this->name_data_.size());
+		this->name_data_.add((char*)name, (char*)name + length);
+		this->name_data_.add('\0');
+
+		size_t slot = hash_name(name, length) & (this->slots_.size() - 1);
+		while (this->slots_[slot] != 0)
+			slot = (slot + 1) & (this->slots_.size() - 1);
+		this->slots_[slot] = id + 1;
+		return id;
+	}
+	Uint32 intern(const char* name, size_t length)
+	{
+		length = min(length, max_name_length);
+		if (this->slots_.size() != 0)
+			for (size_t slot = hash_name(name, length) & (this->slots_.size() - 1); this->slots_[slot] != 0; 
+				 slot = (slot + 1) & (this->slots_.size() - 1)) {
+				const char* existing = this->name(this->slots_[slot] - 1);
+				if (strncmp(existing, name, length) == 0 && existing[length] == '\0')
+					return this->slots_[slot] - 1;
+			}
+
+		return this->add_name(name, length);
+	}
+
+	struct rank_node
+	{
+		Uint32 left, right, size;
+	};
+
+	static constexpr Uint32 no_node = 0xffffffff;
+	static constexpr unsigned priority_key = 0x5c0e5u;
+
+	Uint32 subtree_size(int order, Uint32 node) const noexcept
+	{
+		return node == no_node ? 0 : this->trees_[order][node].size;
+	}
+	void update_size(int order, Uint32 node) noexcept
+	{
+		rank_node& n = this->trees_[order][node];
+		n.size = 1 + this->subtree_size(order, n.left) + this->subtree_size(order, n.right);
+	}
+	void split(int order, Uint32 node, const score_record& record, Uint32* left, Uint32* right)
+	{
+		if (node == no_node) {
+			*left = *right = no_node;
+			return;
+		}
+		rank_node& n = this->trees_[order][node];
+		if (better(order, record, this->records_[node])) {
+			this->split(order, n.left, record, left, &n.left);
+			*right = node;
+		}
+		else {
+			this->split(order, n.right, record, &n.right, right);
+			*left = node;
+		}
+		this->update_size(order, node);
+	}
+	Uint32 merge(int order, Uint32 left, Uint32 right)
+	{
+		if (left == no_node)
+			return right;
+		if (right == no_node)
+			return left;
+
+		dynamic_array<rank_node>& tree = this->trees_[order];
+		if (this->priorities_[left] >= this->priorities_[right]) {
+			tree[left].right = this->merge(order, tree[left].right, right);
+			this->update_size(order, left);
+			return left;
+		}
+		tree[right].left = this->merge(order, left, tree[right].left);
+		this->update_size(order, right);
+		return right;
+	}
+	void build_tree(int order, const Uint32* sorted, size_t count)
+	{
+		dynamic_array<rank_node>& tree = this->trees_[order];
+		tree.resize(count);
+		dynamic_array<Uint32> spine;
+		for (size_t i = 0; i < count; i++) {
+			Uint32 id = sorted[i];
+			Uint32 last = no_node;
+			while (spine.size() != 0 && this->priorities_[spine[spine.size() - 1]] < this->priorities_[id]) {
+				last = spine[spine.size() - 1];
+				spine.resize(spine.size() - 1);
+				this->update_size(order, last);
+			}
+			tree[id] = { last, no_node, 1 };
+			if (spine.size() != 0)
+				tree[spine[spine.size() - 1]].right = id;
+			spine.add(id);
+		}
+		for (size_t i = spine.size(); i > 0; i--)
+			this->update_size(order, spine[i - 1]);
+		this->roots_[order] = spine.size() != 0 ? spine[0] : no_node;
+	}
+
+	void rebuild_indexes()
+	{
+		size_t count = this->records_.size();
+		dynamic_array<Uint32> index(count);
+		dynamic_array<Uint32> scratch(count);
+
+		this->priorities_.resize(count);
+		for (size_t i = 0; i < count; i++)
+			this->priorities_[i] = random_uint(priority_key, (long long)i);
+
+		for (int order = 0; order < score_orders_count; order++) {
+			index.resize(count);
+			for (size_t i = 0; i < count; i++)
+				index[i] = (Uint32)i;
+
+			Uint32* from = index.begin();
+			Uint32* to = scratch.begin();
+			for (size_t width = 1; width < count; width *= 2) {
+				for (size_t first = 0; first < count; first += 2 * width) {
+					size_t middle = min(first + width, count), last = min(first + 2 * width, count);
+					size_t left = first, right = middle, out = first;
+					while (left < middle && right < last)
+						to[out++] = better(order, this->records_[from[right]], this->records_[from[left]]) ? from[right++] : from[left++];
+					while (left < middle)
+						to[out++] = from[left++];
+					while (right < last)
+						to[out++] = from[right++];
+				}
+				Uint32* swap = from;
+				from = to;
+				to = swap;
+			}
+			this->build_tree(order, from, count);
+		}
+	}
+
+	const char* records_path_ = NULL;
+	const char* names_path_ = NULL;
+
+	dynamic_array<score_record> records_;
+	dynamic_array<Uint32> priorities_;
+	dynamic_array<rank_node> trees_[score_orders_count];
+	Uint32 roots_[score_orders_count] = { no_node, no_node };
+
+	dynamic_array<char> name_data_;
+	dynamic_array<Uint32> name_offsets_;
+	dynamic_array<Uint32> slots_;
+};
+
+class leaderboard
+{
+public:
+	static constexpr int capacity = 12;
+
+	leaderboard()
+		:mutex_(SDL_CreateMutex())
+	{
+	}
+	~leaderboard() noexcept
+	{
+		SDL_DestroyMutex(this->mutex_);
+	}
+
+	leaderboard(const leaderboard&) = delete;
+	leaderboard& operator=(const leaderboard&) = delete;
+
+	void load(const score_store& store)
+	{
+		SDL_LockMutex(this->mutex_);
+		for (int order = 0; order < score_orders_count; order++) {
+			Uint32 ids[capacity];
+			size_t count = store.top((score_order)order, ids, capacity);
+			for (size_t i = 0; i < count; i++) {
+				const score_record& record = store.record(ids[i]);
+				const char* name = store.name(record.name);
+				this->insert(order, record.score, record.elapsed_time, name, strlen(name));
+			}
+		}
+		SDL_UnlockMutex(this->mutex_);
+	}
+
+	void add(long score, long elapsed_time, const char* name)
+	{
+		SDL_LockMutex(this->mutex_);
+		this->insert(score_order_points, score, elapsed_time, name, strlen(name));
+		this->insert(score_order_time, score, elapsed_time, name, strlen(name));
+		SDL_UnlockMutex(this->mutex_);
+	}
+
+	template<typename Function>
+	void visit(game_state sort, Function function)
+	{
+		int order = sort == game_state::score_time ? score_order_time : score_order_points;
+		SDL_LockMutex(this->mutex_);
+		function((const score_type*)this->entries_[order], this->counts_[order]);
+		SDL_UnlockMutex(this->mutex_);
+	}
+
+private:
+	static bool better(int order, long score, long elapsed_time, const score_type& other) noexcept
+	{
+		return order == score_order_points ? score > other.score : elapsed_time > other.elapsed_time;
+	}
+
+	void insert(int order, long score, long elapsed_time, const char* name, size_t name_length)
+	{
+		score_type* entries = this->entries_[order];
+		int count = this->counts_[order];
+		if (count == capacity && !better(order, score, elapsed_time, entries[capacity - 1]))
+			return;
+
+		int i = min(count, capacity - 1);
+		for (; i > 0 && better(order, score, elapsed_time, entries[i - 1]); i--)
+			entries[i] = move(entries[i - 1]);
+
+		score_type entry;
+		entry.name = (char*)malloc(name_length + 1);
+		memcpy(entry.name, name, name_length);
+		entry.name[name_length] = NULL;
+		entry.score = score;
+		entry.elapsed_time = elapsed_time;
+		entries[i] = move(entry);
+
+		this->counts_[order] = min(count + 1, capacity);
+	}
+
+	score_type entries_[score_orders_count][capacity];
+	int counts_[score_orders_count] = {};
+	SDL_mutex* mutex_;
+};
+
+class background_layer
+{
+public:
+	background_layer() = default;
+	~background_layer() noexcept
+	{
+		if (this->texture_)
+			SDL_DestroyTexture(this->texture_);
+	}
+
+	background_layer(const background_layer&) = delete;
+	background_layer& operator=(const background_layer&) = delete;
+
+	void create(screen_type* screen)
+	{
+		if (screen->targets_supported())
+			this->texture_ = SDL_CreateTexture(screen->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+											   screen->width, ring_rows * row_height(screen->height));
+		if (this->texture_)
+			SDL_SetTextureBlendMode(this->texture_, SDL_BLENDMODE_NONE);
+	}
+
+	void invalidate()
+	{
+		this->valid_ = false;
+	}
+
+	void update(screen_type* screen, const texture_type* tree_texture, const render_frame& frame)
+	{
+		if (this->texture_ && frame.strips.size() != 0)
+			this->paint(screen, tree_texture, frame, frame.height / game_data::game_height);
+	}
+
+	void draw(screen_type* screen, const texture_type* tree_texture, const render_frame& frame)
+	{
+		int strip_height = frame.height / game_data::game_height;
+		int base = frame.height - game_data::menu_bar_height - game_data::baseline_offset;
+		point offset = frame.view.zoom_offset;
+
+		if (!this->texture_) {
+			for (const background_strip& strip : frame.strips)
+				draw_rect(screen, { offset.x + strip.x, offset.y + base - 
+									(int)((strip.row - frame.origin - frame.camera_y) * row_height(frame.height)) },
+						  { strip.width, strip_height }, color::green());
+			for (const background_tree& t : frame.trees)
+				draw_texture(screen, tree_texture, { offset.x + t.x, offset.y + base - 
+													 (int)((t.row - frame.origin - frame.camera_y) * row_height(frame.height)) });
+			return;
+		}
+
+		int ring_height = ring_rows * row_height(frame.height);
+		float camera_floor = floorf(frame.camera_y);
+		long long camera_row = frame.origin + (long long)camera_floor;
+		int shift = base - (int)((camera_floor - frame.camera_y) * row_height(frame.height)) - ring_y(camera_row, frame.height);
+
+		int source_y = wrap(-shift, ring_height);
+		int first_height = min(frame.height, ring_height - source_y);
+
+		screen->rects.flush(screen->renderer);
+		SDL_Rect source = { 0, source_y, frame.width, first_height };
+		SDL_Rect target = { offset.x, offset.y, frame.width, first_height };
+		SDL_RenderCopy(screen->renderer, this->texture_, &source, &target);
+		if (first_height < frame.height) {
+			source = { 0, 0, frame.width, frame.height - first_height };
+			target = { offset.x, offset.y + first_height, frame.width, frame.height - first_height };
+			SDL_RenderCopy(screen->renderer, this->texture_, &source, &target);
+		}
+	}
+
+private:
+	static constexpr int ring_rows = 64;
+	static constexpr int rows_back = 16;
+	static constexpr int tree_rows = 2;
+
+	static int row_height(int height) noexcept
+	{
+		return (height - 2 * game_data::menu_bar_height) / game_data::game_height;
+	}
+	static int wrap(long long value, long long range) noexcept
+	{
+		return (int)(((value % range) + range) % range);
+	}
+	static int ring_y(long long row, int height) noexcept
+	{
+		return wrap(-row * row_height(height), ring_rows * row_height(height));
+	}
+
+	void paint_rect(screen_type* screen, point pos, point size, int ring_height)
+	{
+		draw_rect(screen, pos, size, color::green());
+		if (pos.y + size.y > ring_height)
+			draw_rect(screen, { pos.x, pos.y - ring_height }, size, color::green());
+	}
+	void paint_tree(screen_type* screen, const texture_type* tree_texture, point pos, int ring_height)
+	{
+		draw_texture(screen, tree_texture, pos);
+		if (pos.y + tree_texture->source.h / 2 > ring_height)
+			draw_texture(screen, tree_texture, { pos.x, pos.y - ring_height });
+		else if (pos.y - tree_texture->source.h / 2 < 0)
+			draw_texture(screen, tree_texture, { pos.x, pos.y + ring_height });
+	}
+
+	void paint(screen_type* screen, const texture_type* tree_texture, const render_frame& frame, int strip_height)
+	{
+		int ring_height = ring_rows * row_height(frame.height);
+		long long first_row = frame.strips[0].row;
+		long long last_row = frame.strips[frame.strips.size() - 1].row;
+		long long camera_row = frame.origin + (long long)floorf(frame.camera_y);
+
+		SDL_SetRenderTarget(screen->renderer, this->texture_);
+
+		if (!this->valid_ || this->seed_ != frame.random_seed || this->painted_to_ < first_row ||
+			this->painted_to_ - ring_rows > camera_row - rows_back) {
+			SDL_SetRenderDrawColor(screen->renderer, 0, 0, 0, 255);
+			SDL_RenderClear(screen->renderer);
+
+			this->valid_ = true;
+			this->seed_ = frame.random_seed;
+			this->painted_to_ = first_row;
+			this->trees_painted_to_ = first_row;
+		}
+
+		long long paint_to = min(last_row + 1, camera_row + ring_rows - rows_back);
+		long long cleared_row = this->painted_to_ - 1;
+		for (const background_strip& strip : frame.strips) {
+			if (strip.row < this->painted_to_ || strip.row >= paint_to)
+				continue;
+
+			int y = ring_y(strip.row, frame.height);
+			if (strip.row != cleared_row) {
+				screen->rects.flush(screen->renderer);
+				SDL_Rect band = { 0, y, frame.width, row_height(frame.height) };
+				SDL_SetRenderDrawColor(screen->renderer, 0, 0, 0, 255);
+				SDL_RenderFillRect(screen->renderer, &band);
+				cleared_row = strip.row;
+			}
+			this->paint_rect(screen, { strip.x, y }, { strip.width, strip_height }, ring_height);
+		}
+		this->painted_to_ = max(this->painted_to_, paint_to);
+
+		long long trees_to = this->painted_to_ - tree_rows;
+		for (const background_tree& t : frame.trees)
+			if (t.row >= this->trees_painted_to_ && t.row < trees_to)
+				this->paint_tree(screen, tree_texture, { t.x, ring_y(t.row, frame.height) }, ring_height);
+		this->trees_painted_to_ = max(this->trees_painted_to_, trees_to);
+
+		screen->rects.flush(screen->renderer);
+		SDL_SetRenderTarget(screen->renderer, NULL);
+	}
+
+	SDL_Texture* texture_ = NULL;
+	bool valid_ = false;
+	unsigned long long seed_ = 0;
+	long long painted_to_ = 0;
+	long long trees_painted_to_ = 0;
+};
+
+class hud_layer
 {
-	coord main_car_pos = render_data.game->entities[entity_main_car][0]->position;
+public:
+	hud_layer() = default;
+	~hud_layer() noexcept
+	{
+		if (this->static_top_)
+			SDL_DestroyTexture(this->static_top_);
+		if (this->bottom_)
+			SDL_DestroyTexture(this->bottom_);
+	}
 
-	return { (int)(render_data.screen->width / 2 +
-					   (val.x) * render_data.screen->width / game_data::game_width),
-		render_data.screen->height - game_data::menu_bar_height - (int)(
-			game_data::baseline_offset + (val.y - main_car_pos.y) *
-			(render_data.screen->height - 2 * game_data::menu_bar_height) / game_data::game_height) };
-}
-point game_to_screen(const render_data_type& render_data, coord size)
-{
-	return { (int)(size.x * render_data.screen->width / game_data::game_width),
-	(int)(size.y * render_data.screen->height / game_data::game_height) };
-}
+	hud_layer(const hud_layer&) = delete;
+	hud_layer& operator=(const hud_layer&) = delete;
 
-struct score_type
-{
-	score_type() = default;
+	void create(screen_type* screen, const font_type* font)
+	{
+		if (!screen->targets_supported())
+			return;
 
-	score_type(const score_type&) = delete;
-	score_type& operator=(const score_type&) = delete;
+		this->static_top_ = create_bar(screen);
+		this->bottom_ = create_bar(screen);
+		this->invalidate(screen, font);
+	}
+	void invalidate(screen_type* screen, const font_type* font)
+	{
+		if (!this->static_top_ || !this->bottom_)
+			return;
 
-	score_type(score_type&& other) noexcept
+		screen->rects.flush(screen->renderer);
+		SDL_SetRenderTarget(screen->renderer, this->static_top_);
+		draw_top_bar(screen, font);
+		screen->rects.flush(screen->renderer);
+
+		SDL_SetRenderTarget(screen->renderer, this->bottom_);
+		draw_bottom_bar(screen, font, 0);
+		screen->rects.flush(screen->renderer);
+
+		SDL_SetRenderTarget(screen->renderer, NULL);
+	}
+
+	void draw(screen_type* screen, const font_type* font, const render_frame& frame)
 	{
-		this->name = other.name;
-		other.name = NULL;
-		this->score = other.score;
-		this->elapsed_time = other.elapsed_time;
+		char countdown[32] = {};
+		char status[256] = {};
+		format_status(frame, countdown, status);
+
+		if (!this->static_top_ || !this->bottom_) {
+			draw_top_bar(screen, font);
+			draw_status(screen, font, countdown, status);
+			draw_bottom_bar(screen, font, screen->height - game_data::menu_bar_height);
+			return;
+		}
+
+		screen->rects.flush(screen->renderer);
+		SDL_Rect target = { 0, 0, screen->width, game_data::menu_bar_height };
+		SDL_RenderCopy(screen->renderer, this->static_top_, NULL, &target);
+		target.y = screen->height - game_data::menu_bar_height;
+		SDL_RenderCopy(screen->renderer, this->bottom_, NULL, &target);
+		draw_status(screen, font, countdown, status);
 	}
-	score_type& operator=(score_type&& other) noexcept
+
+private:
+	static constexpr int inner_bar_offset = (game_data::menu_bar_height - game_data::inner_menu_bar_height) / 2;
+	static constexpr int text_offset = (game_data::menu_bar_height - 8) / 2;
+
+	static SDL_Texture* create_bar(screen_type* screen)
 	{
-		if (this->name)
-			free(this->name);
-		this->name = other.name;
-		other.name = NULL;
-		this->score = other.score;
-		this->elapsed_time = other.elapsed_time;
-		return *this;
+		SDL_Texture* texture = SDL_CreateTexture(screen->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+												 screen->width, game_data::menu_bar_height);
+		if (texture)
+			SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_NONE);
+		return texture;
 	}
 
-	~score_type()
+	static void format_status(const render_frame& frame, char* countdown, char* status)
 	{
-		if (this->name)
-			free(this->name);
+		char lives[128] = {};
+
+		if (frame.elapsed_time / 1000 < game_data::free_respawn_time)
+			sprintf_s(countdown, 32, "%li", game_data::free_respawn_time - frame.elapsed_time / 1000);
+		else
+			sprintf_s(lives, sizeof(lives), "Lives: %li   ", frame.lives + 1);
+
+		sprintf_s(status, 256, "%sScore: %li   Elapsed time: %.3f", lives, frame.score, frame.elapsed_time / 1000.f);
 	}
 
-	char* name = NULL;
-	long score;
-	long elapsed_time;
+	static void draw_top_bar(screen_type* screen, const font_type* font)
+	{
+		draw_rect(screen, { 0, 0 }, { screen->width, game_data::menu_bar_height }, color::yellow());
+		draw_rect(screen, { 0, inner_bar_offset }, { screen->width, game_data::inner_menu_bar_height }, color::red());
+
+		draw_text(screen, font, "Wojciech Slomowicz, 193151", { game_data::menu_text_offset, text_offset });
+	}
+	static void draw_bottom_bar(screen_type* screen, const font_type* font, int y)
+	{
+		draw_rect(screen, { 0, y }, { screen->width, game_data::menu_bar_height }, color::yellow());
+		draw_rect(screen, { 0, y + inner_bar_offset }, { screen->width, game_data::inner_menu_bar_height }, color::red());
+
+		draw_text_right(screen, font, "Implemented features: a, b, c, d, e, f, g, h, i, j, k, l, m, n, o",
+						{ screen->width - game_data::menu_text_offset, y + game_data::menu_bar_height - text_offset - 8 });
+	}
+	static void draw_status(screen_type* screen, const font_type* font, const char* countdown, const char* status)
+	{
+		if (countdown[0])
+			draw_text_center(screen, font, countdown, { screen->width / 2, text_offset });
+		draw_text_right(screen, font, status, { screen->width - game_data::menu_text_offset, text_offset });
+	}
+
+	SDL_Texture* static_top_ = NULL;
+	SDL_Texture* bottom_ = NULL;
 };
 
-void get_scores(score_type* scores, int* count, game_state sort)
+struct render_data_type
 {
-	FILE* file;
-	fopen_s(&file, "scores.txt", "rb");
-	if (!file) {
-		*count = 0;
-		return;
-	}
-	fseek(file, 0, SEEK_END);
-	long length = ftell(file);
-	char* buffer = (char*)malloc(length + 1);
-	fseek(file, 0, SEEK_SET);
-	fread(buffer, 1, length, file);
-	buffer[length] = NULL;
-	fclose(file);
+	screen_type* screen = nullptr;
+	unique_ptr<texture_atlas> atlas;
+	font_type font;
+	texture_type textures[sprites_count];
+	texture_type rotated[sprites_rotated_count][2 * game_data::rotation_steps + 1];
+	background_layer background;
+	hud_layer hud;
+	text_cache text;
+	dynamic_resolution scene;
+	frame_capture* capture = nullptr;
+	leaderboard* scores = nullptr;
+
+	bool report_culling = false;
+	unsigned long drawn = 0;
+	unsigned long culled = 0;
+	Uint32 report_time = 0;
+};
+static constexpr int rotation_frames_count = 2 * game_data::rotation_steps + 1;
+static constexpr int assets_count = sprites_count + 1 + sprites_rotated_count * (rotation_frames_count - 1);
+
+static constexpr const char* asset_paths[sprites_count + 1] = {
+	"sprites/main_car0.bmp", "sprites/main_car1.bmp",
+	"sprites/trap_car0.bmp", "sprites/trap_car1.bmp",
+	"sprites/tank_car.bmp",
+	"sprites/regular_car.bmp",
+	"sprites/car_destroy0.bmp", "sprites/car_destroy1.bmp", "sprites/car_destroy2.bmp",
+	"sprites/explosion0.bmp", "sprites/explosion1.bmp", "sprites/explosion2.bmp",
+	"sprites/tree.bmp", "sprites/puddle.bmp", "sprites/box.bmp", "sprites/trap.bmp",
+	"cs8x8.bmp"
+};
 
-	int read = 0;
-	size_t line_length;
-	
-	for (char* it = buffer, *end = buffer + length; it != end; it += line_length + 1)
-	{
-		line_length = strchr(it, '\n') - it;
-
-		score_type score;
-		int read_count;
-		sscanf_s(it, "%li %li%n", &score.score, &score.elapsed_time, &read_count);
-
-		if (read < *count || (sort == game_state::score_points && score.score > scores[*count - 1].score) ||
-			(sort == game_state::score_time && score.elapsed_time > scores[*count - 1].elapsed_time)) {
-			score.name = (char*)malloc(line_length - read_count);
-			memcpy(score.name, it + read_count + 1, line_length - read_count - 1);
-			score.name[line_length - read_count - 1] = NULL;
-			if (score.name[line_length - read_count - 2] == '\r') score.name[line_length - read_count - 2] = NULL;
-
-			for (int i = read; i >= 0; i--)
-				if (i == 0 || (sort == game_state::score_points && score.score < scores[i - 1].score) ||
-					(sort == game_state::score_time && score.elapsed_time < scores[i - 1].elapsed_time))
-				{
-					for (int j = *count - 1; j > i; j--)
-						scores[j] = move(scores[j - 1]);
-					scores[i] = move(score);
-					if (read < *count)
-						read++;
-					break;
-				}
+void decode_assets(SDL_Surface** surfaces, job_system* jobs)
+{
+	job_counter decoded, rotated;
+	for (int i = 0; i <= sprites_count; i++)
+		jobs->run([=]() {
+			try {
+				surfaces[i] = load_surface(asset_paths[i], i < sprites_count ? 0xffffffff : 0x000000ff);
+			}
+			catch (int) {
+				surfaces[i] = NULL;
+			}
+		}, &decoded);
+
+	static constexpr int rotations_count = assets_count - sprites_count - 1;
+	static constexpr int rotations_grain = 4;
+	for (int first = 0; first < rotations_count; first += rotations_grain)
+		jobs->run([=]() {
+			for (int i = first; i < min(first + rotations_grain, rotations_count); i++) {
+				int sprite = i / (rotation_frames_count - 1), step = i % (rotation_frames_count - 1);
+				if (step >= game_data::rotation_steps)
+					step++;
+
+				SDL_Surface* rotated_surface = NULL;
+				if (surfaces[sprite])
+					try {
+						rotated_surface = rotate_surface(surfaces[sprite], (step - game_data::rotation_steps) * game_data::rotation_step);
+					}
+					catch (int) {
+					}
+				surfaces[sprites_count + 1 + i] = rotated_surface;
+			}
+		}, &rotated, &decoded);
+
+	jobs->wait(&rotated);
+	jobs->wait(&decoded);
+
+	for (int i = 0; i < assets_count; i++)
+		if (surfaces[i] == NULL) {
+			for (int j = 0; j < assets_count; j++)
+				if (surfaces[j])
+					SDL_FreeSurface(surfaces[j]);
+			throw EXIT_FAILURE;
 		}
-	}
+}
+bool load_asset_pack(asset_pack* pack, SDL_Surface** surfaces)
+{
+	char path[1024];
+	char* base = SDL_GetBasePath();
+	sprintf_s(path, sizeof(path), "%s%s", base ? base : "", game_data::asset_pack_file);
+	SDL_free(base);
+
+	if (!pack->load(path) || pack->count() != assets_count)
+		return false;
+
+	for (int i = 0; i < assets_count; i++)
+		if (!(surfaces[i] = pack->surface(i))) {
+			for (int j = 0; j < i; j++)
+				SDL_FreeSurface(surfaces[j]);
+			return false;
+		}
+	return true;
+}
+
+void load_textures(render_data_type* data, job_system* jobs)
+{
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	asset_pack pack;
+	dynamic_array<SDL_Surface*> surfaces(assets_count);
+	bool packed = load_asset_pack(&pack, surfaces.begin());
+	if (!packed)
+		decode_assets(surfaces.begin(), jobs);
+
+	Uint64 decoded = SDL_GetPerformanceCounter();
 
-	free(buffer);
-	*count = read;
+	try {
+		data->atlas = new texture_atlas(surfaces.begin(), (int)surfaces.size(), 
+										data->screen->software.get() ? NULL : data->screen->renderer);
+	}
+	catch (int) {
+		for (SDL_Surface* surface : surfaces)
+			SDL_FreeSurface(surface);
+		throw;
+	}
+	for (int i = 0; i < sprites_count; i++)
+		data->textures[i] = { data->atlas->texture, data->atlas->surface, data->atlas->rects[i] };
+	data->font = { data->atlas->texture, data->atlas->surface, data->atlas->rects[sprites_count] };
+
+	int rect = sprites_count + 1;
+	for (int i = 0; i < sprites_rotated_count; i++)
+		for (int j = 0; j < rotation_frames_count; j++)
+			data->rotated[i][j] = j == game_data::rotation_steps ? data->textures[i] : 
+								  texture_type{ data->atlas->texture, data->atlas->surface, data->atlas->rects[rect++] };
+
+	for (SDL_Surface* surface : surfaces)
+		SDL_FreeSurface(surface);
+
+	Uint64 frequency = SDL_GetPerformanceFrequency();
+	Uint64 finished = SDL_GetPerformanceCounter();
+	printf("Loaded %zu images from %s in %.2f ms (decode %.2f ms, atlas %.2f ms).\n", surfaces.size(), 
+		   packed ? game_data::asset_pack_file : "BMP files",
+		   (finished - start) * 1000.0 / frequency, (decoded - start) * 1000.0 / frequency,
+		   (finished - decoded) * 1000.0 / frequency);
 }
 
-void draw_overlay(const render_data_type& data)
+void draw_overlay(render_data_type& data, const render_frame& frame)
 {
-	if (data.game->state == game_state::paused) {
+	if (frame.state == game_state::paused) {
 		draw_rect(data.screen, { 0, 0 }, { data.screen->width, data.screen->height }, { 0, 0, 0, 96 });
-		draw_text_center(data.screen, data.font, "Paused", { data.screen->width / 2, data.screen->height / 2 - 4 });
+		data.text.draw_center(data.screen, &data.font, "Paused", { data.screen->width / 2, data.screen->height / 2 - 4 });
 	}
-	else if (data.game->state == game_state::score_points || 
-			 data.game->state == game_state::score_time || data.game->state == game_state::finished)
+	else if (frame.state == game_state::score_points || 
+			 frame.state == game_state::score_time || frame.state == game_state::finished)
 	{
 		point overlay_pos = { data.screen->width / 6, data.screen->height / 6 };
 		point overlay_size = { 2 * data.screen->width / 3, 2 * data.screen->height / 3 };
@@ -657,93 +1865,188 @@ void draw_overlay(const render_data_type& data)
 		point info_pos = { inner_overlay_pos.x + game_data::menu_text_offset, inner_overlay_pos.y + inner_overlay_size.y / 2 };
 		char text[128];
 
-		if (data.game->state == game_state::finished) {
-			draw_text_center(data.screen, data.font, "You died", main_message_pos);
+		if (frame.state == game_state::finished) {
+			data.text.draw_center(data.screen, &data.font, "You died", main_message_pos);
 
 			info_pos.x += game_data::menu_text_offset;
 			info_pos.y -= 8;
 
-			sprintf_s(text, "You survived for %.3f seconds.", data.game->elapsed_time / 1000.f);
-			draw_text(data.screen, data.font, text, info_pos);
+			sprintf_s(text, "You survived for %.3f seconds.", frame.elapsed_time / 1000.f);
+			data.text.draw(data.screen, &data.font, text, info_pos);
 			info_pos.y += 16;
 
-			sprintf_s(text, "Your score: %li.", data.game->score);
-			draw_text(data.screen, data.font, text, info_pos);
+			sprintf_s(text, "Your score: %li.", frame.score);
+			data.text.draw(data.screen, &data.font, text, info_pos);
 			info_pos.y += 16;
 		}
 		else {
-			draw_text_center(data.screen, data.font, "Best scores", main_message_pos);
+			data.text.draw_center(data.screen, &data.font, "Best scores", main_message_pos);
 			main_message_pos.y += inner_overlay_size.y - 2 * text_offset - 8;
-			draw_text_center(data.screen, data.font, "Best scores", main_message_pos);
-
-			score_type best_scores[12] = {};
-			int count = 12;
-			get_scores(best_scores, &count, data.game->state);
-
-			info_pos.y -= 16 * count / 2;
-			for (int i = 0; i < count; i++) {
-				sprintf_s(text, "%2i. Score: %6li; Time: %9.3f - %s", 
-						  i + 1, best_scores[i].score, best_scores[i].elapsed_time / 1000.f, best_scores[i].name);
-				draw_text(data.screen, data.font, text, info_pos);
-				info_pos.y += 16;
-			}
+			data.text.draw_center(data.screen, &data.font, "Best scores", main_message_pos);
+
+			data.scores->visit(frame.state, [&](const score_type* best_scores, int count) {
+				info_pos.y -= 16 * count / 2;
+				for (int i = 0; i < count; i++) {
+					sprintf_s(text, "%2i. Score: %6li; Time: %9.3f - %s", 
+							  i + 1, best_scores[i].score, best_scores[i].elapsed_time / 1000.f, best_scores[i].name);
+					data.text.draw(data.screen, &data.font, text, info_pos);
+					info_pos.y += 16;
+				}
+			});
 		}
 	}
 }
-void draw(const render_data_type& data)
+void build_frame(const game_data* data, const particle_pool* particles, const screen_type* screen, camera* view, 
+				 render_frame* frame)
 {
-	static constexpr int inner_bar_offset = (game_data::menu_bar_height - game_data::inner_menu_bar_height) / 2;
-	static constexpr int text_offset = (game_data::menu_bar_height - 8) / 2;
+	view->update(data->entities[entity_main_car][0]->position.y, data->origin);
 
-	for (int i = 0; i < entity_count; i++)
-		for (unique_ptr<entity>& e : data.game->entities[i])
-			e->render(data);
+	frame->width = screen->width;
+	frame->height = screen->height;
+	frame->camera_y = view->y();
+	frame->view.build(screen->width, screen->height, view->y(), screen->software.get() ? 1.f : view->zoom());
+	frame->origin = data->origin;
+	frame->random_seed = data->random_seed;
+
+	frame->state = data->state;
+	frame->lives = data->lives;
+	frame->score = data->score;
+	frame->elapsed_time = data->elapsed_time;
 
-	draw_rect(data.screen, { 0, 0 },
-			  { data.screen->width, game_data::menu_bar_height }, color::yellow());
-	draw_rect(data.screen, { 0, inner_bar_offset },
-			  { data.screen->width,  game_data::inner_menu_bar_height }, color::red());
+	frame->clear();
+	for (int i = 0; i < entity_count; i++) {
+		frame->layer = i;
+		for (const unique_ptr<entity>& e : data->entities[i])
+			e->render(*frame);
+	}
+	for (size_t i = 0; i < particles->size(); i++) {
+		int step = min((int)(particles->age(i) * game_data::particle_shades), game_data::particle_shades - 1);
+		frame->add_particle(particles->position(i), particles->size(i), particles->kind(i) * game_data::particle_shades + step);
+	}
+	frame->transform_commands();
+	frame->sort_commands();
+	frame->transform_particles();
+}
+color particle_color(int shade)
+{
+	static constexpr color ramps[particle_kinds_count][2] = {
+		{ { 0xff, 0xe0, 0x40, 0xff }, { 0xa0, 0x20, 0x00, 0x00 } },
+		{ { 0x90, 0x90, 0x90, 0xc0 }, { 0x40, 0x40, 0x40, 0x00 } },
+		{ { 0x50, 0x48, 0x40, 0xff }, { 0x20, 0x20, 0x20, 0x40 } }
+	};
 
-	draw_rect(data.screen, { 0, data.screen->height - game_data::menu_bar_height },
-			  { data.screen->width, game_data::menu_bar_height }, color::yellow());
-	draw_rect(data.screen, { 0, data.screen->height - game_data::inner_menu_bar_height - inner_bar_offset },
-			  { data.screen->width,  game_data::inner_menu_bar_height }, color::red());
+	const color* ramp = ramps[shade / game_data::particle_shades];
+	int t = shade % game_data::particle_shades;
+	int n = game_data::particle_shades - 1;
+	return { (unsigned char)((ramp[0].r * (n - t) + ramp[1].r * t) / n), (unsigned char)((ramp[0].g * (n - t) + ramp[1].g * t) / n),
+			 (unsigned char)((ramp[0].b * (n - t) + ramp[1].b * t) / n), (unsigned char)((ramp[0].a * (n - t) + ramp[1].a * t) / n) };
+}
+void draw(render_data_type& data, const render_frame& frame)
+{
+	if (SDL_AtomicSet(&data.screen->size_changed, 0) != 0 && data.screen->renderer)
+		SDL_RenderSetLogicalSize(data.screen->renderer, data.screen->width, data.screen->height);
+	if (SDL_AtomicSet(&data.screen->targets_reset, 0) != 0) {
+		data.background.invalidate();
+		data.hud.invalidate(data.screen, &data.font);
+		data.text.clear();
+	}
 
-	char text[256] = {};
-	char lives[128] = {};
+	data.background.update(data.screen, &data.textures[sprite_tree], frame);
+	data.scene.begin(data.screen);
 
-	if (data.game->elapsed_time / 1000 < game_data::free_respawn_time) {
-		sprintf_s(text, sizeof(text), "%li", game_data::free_respawn_time - data.game->elapsed_time / 1000);
-		draw_text_center(data.screen, data.font, text, { data.screen->width / 2, text_offset });
+	float scale_x = 1.f, scale_y = 1.f;
+	bool zoomed = frame.view.zoom != 1.f && !data.screen->software.get();
+	if (zoomed) {
+		data.screen->rects.flush(data.screen->renderer);
+		SDL_RenderGetScale(data.screen->renderer, &scale_x, &scale_y);
+		SDL_RenderSetScale(data.screen->renderer, scale_x * frame.view.zoom, scale_y * frame.view.zoom);
 	}
-	else
-		sprintf_s(lives, sizeof(lives), "Lives: %li   ", data.game->lives + 1);
-	
-	sprintf_s(text, sizeof(text), "%sScore: %li   Elapsed time: %.3f", lives, data.game->score, data.game->elapsed_time / 1000.f);
-
-	draw_text(data.screen, data.font, "Wojciech Slomowicz, 193151",
-			  { game_data::menu_text_offset, text_offset });
-	draw_text_right(data.screen, data.font, text,
-					{ data.screen->width - game_data::menu_text_offset, text_offset });
-	draw_text_right(data.screen, data.font, "Implemented features: a, b, c, d, e, f, g, h, i, j, k, l, m, n, o",
-					{ data.screen->width - game_data::menu_text_offset, data.screen->height - text_offset - 8 });
-
-	draw_overlay(data);
+
+	data.background.draw(data.screen, &data.textures[sprite_tree], frame);
+
+	int top = (int)(game_data::menu_bar_height / frame.view.zoom);
+	int bottom = (int)ceilf((frame.height - game_data::menu_bar_height) / frame.view.zoom);
+	int right = (int)ceilf(frame.width / frame.view.zoom);
+
+	for (const render_command& command : frame.commands) {
+		point half_size;
+		point center = command.pos;
+		if (command.type == render_command_rect) {
+			half_size = { command.size.x / 2, command.size.y / 2 };
+			center = { command.pos.x + half_size.x, command.pos.y + half_size.y };
+		}
+		else {
+			const SDL_Rect& source = data.textures[command.sprite].source;
+			half_size = command.type == render_command_rotated_sprite ? point{ (source.w + source.h) / 2, (source.w + source.h) / 2 } : 
+											   point{ source.w / 2, source.h / 2 };
+		}
+
+		if (center.y + half_size.y < top || center.y - half_size.y > bottom ||
+			center.x + half_size.x < 0 || center.x - half_size.x > right) {
+			data.culled++;
+			continue;
+		}
+		data.drawn++;
+
+		switch (command.type)
+		{
+			case render_command_rect:
+				draw_rect(data.screen, command.pos, command.size, command.c);
+				break;
+			case render_command_sprite:
+				draw_texture(data.screen, &data.textures[command.sprite], command.pos);
+				break;
+			case render_command_rotated_sprite:
+				if (command.sprite < sprites_rotated_count && 
+				    fabsf(command.angle) <= game_data::rotation_steps * game_data::rotation_step) {
+					int frame_index = (int)roundf(command.angle / game_data::rotation_step) + game_data::rotation_steps;
+					draw_texture(data.screen, &data.rotated[command.sprite][frame_index], command.pos);
+				}
+				else
+					draw_texture(data.screen, &data.textures[command.sprite], command.pos, command.angle);
+				break;
+			default:
+				break;
+		}
+	}
+
+	for (int shade = 0; shade < particle_shades_count; shade++) {
+		size_t first = frame.particle_offsets[shade];
+		size_t count = frame.particle_offsets[shade + 1] - first;
+		if (count != 0)
+			fill_rects(data.screen, &frame.particles[first], (int)count, particle_color(shade));
+	}
+
+	if (zoomed) {
+		data.screen->rects.flush(data.screen->renderer);
+		SDL_RenderSetScale(data.screen->renderer, scale_x, scale_y);
+	}
+	data.scene.end(data.screen);
+
+	if (data.report_culling && SDL_TICKS_PASSED(SDL_GetTicks(), data.report_time)) {
+		if (data.report_time != 0)
+			printf("Renderer: %lu commands drawn, %lu culled.\n", data.drawn, data.culled);
+		data.drawn = 0;
+		data.culled = 0;
+		data.report_time = SDL_GetTicks() + 10000;
+	}
+
+	data.hud.draw(data.screen, &data.font, frame);
+
+	draw_overlay(data, frame);
 }
 
 void get_text(char** text, const char* title, const char* message);
-void save_score(game_data* data)
+void save_score(const game_data* data, score_store* store, leaderboard* scores)
 {
 	char* text = NULL;
 	get_text(&text, "Name", "Enter your name:");
 	if (text)
 	{
-		FILE* file;
-		fopen_s(&file, "scores.txt", "ab");
-		if (file) {
-			fprintf(file, "%li %li %s\n", data->score, data->elapsed_time, text);
-			fclose(file);
-		}
+		printf("Score %li ranks %zu of %zu.\n", data->score, 
+			   store->rank(score_order_points, data->score, data->elapsed_time), store->size() + 1);
+		store->add(data->score, data->elapsed_time, text);
+		scores->add(data->score, data->elapsed_time, text);
 		free(text);
 	}
 }
@@ -905,7 +2208,40 @@ direction tank_car_turn_behaviour(game_data* data, car* c)
 	return direction_up;
 }
 
-void clean_entities(game_data* data)
+void emit_burst(particle_pool* particles, coord position, coord velocity, int count, particle_kind kind,
+				float speed, float lifetime, float size)
+{
+	for (int i = 0; i < count; i++) {
+		float angle = particles->random() * 2.f * (float)M_PI;
+		float s = speed * (0.25f + 0.75f * particles->random());
+		particles->emit(position, { velocity.x + cosf(angle) * s, velocity.y + sinf(angle) * s },
+						lifetime * (0.5f + 0.5f * particles->random()), size * (0.5f + particles->random()), kind);
+	}
+}
+void emit_explosion(particle_pool* particles, coord position)
+{
+	emit_burst(particles, position, {}, 160, particle_fire, 24.f, 0.5f, 0.5f);
+	emit_burst(particles, position, {}, 64, particle_smoke, 8.f, 1.2f, 1.f);
+}
+void emit_tyre_smoke(particle_pool* particles, const car* c, float delta)
+{
+	static constexpr float rate = 120.f;
+
+	int count = (int)(rate * delta + particles->random());
+	for (int i = 0; i < count; i++) {
+		float side = (i & 1) ? 1.f : -1.f;
+		particles->emit({ c->position.x + side * c->hitbox_size.x * 0.4f, c->position.y - c->hitbox_size.y * 0.5f },
+						{ (particles->random() - 0.5f) * 2.f, c->speed * 0.2f },
+						0.4f + 0.4f * particles->random(), 0.4f + 0.3f * particles->random(), particle_smoke);
+	}
+}
+void destroy_car(car* c, particle_pool* particles)
+{
+	c->destroy();
+	emit_burst(particles, c->position, { 0.f, c->speed }, 48, particle_debris, 16.f, 0.8f, 0.3f);
+	emit_burst(particles, c->position, { 0.f, c->speed * 0.5f }, 32, particle_smoke, 6.f, 1.f, 1.f);
+}
+void clean_entities(game_data* data, particle_pool* particles)
 {
 	float main_car_pos = data->entities[entity_main_car][0]->position.y;
 
@@ -937,8 +2273,10 @@ void clean_entities(game_data* data)
 	for (int i = 0; i < data->entities[entity_bullet].size();) {
 		bullet* b = (bullet*)data->entities[entity_bullet][i].get();
 		if (b->lifetime <= 0.f) {
-			if (b->explodes)
+			if (b->explodes) {
 				data->entities[entity_explosion].add(new explosion(b->position, game_data::explosion_time));
+				emit_explosion(particles, b->position);
+			}
 			data->entities[entity_bullet].erase(data->entities[entity_bullet].begin() + i);
 		}
 		else
@@ -953,30 +2291,73 @@ void clean_entities(game_data* data)
 			i++;
 	}
 }
-void generate_road(game_data* data)
+void generate_rows(unsigned long long seed, long long first_row, int count, terrain_state* terrain, generated_row* generated)
 {
-	float opt = random_float(data->random_seed);
-	data->road_size_first += (opt > 0.8f ? 1 : opt < 0.2f ? -1 : 0) * 0.02f;
-	data->road_size_first = clamp(data->road_size_first, -0.06f, 0.06f);
-	data->road_size_zeroth += data->road_size_first;
+	static constexpr int streams_count = stream_box_pos + 1;
+	static constexpr int rows_count = generated_chunk::rows_count;
+
+	float randoms[streams_count][rows_count];
+	float size_steps[rows_count];
+	float pos_steps[rows_count];
+
+	for (int first = 0; first < count; first += rows_count) {
+		int batch = min(count - first, rows_count);
+		for (int i = 0; i < streams_count; i++)
+			random_floats(seed, first_row + first, i, batch, randoms[i]);
+
+		for (int i = 0; i < batch; i++) {
+			float size_opt = randoms[stream_road_size][i];
+			float pos_opt = randoms[stream_road_pos][i];
+			size_steps[i] = (size_opt > 0.8f ? 1 : size_opt < 0.2f ? -1 : 0) * 0.02f;
+			pos_steps[i] = (pos_opt > 0.8f ? 1 : pos_opt < 0.2f ? -1 : 0) * 0.02f;
+		}
+
+		for (int i = 0; i < batch; i++) {
+			generated_row* row = &generated[first + i];
+
+			terrain->road_size_first = clamp(terrain->road_size_first + size_steps[i], -0.06f, 0.06f);
+			terrain->road_size_zeroth = clamp(terrain->road_size_zeroth + terrain->road_size_first,
+											  (float)game_data::road_min, (float)game_data::road_max);
+
+			terrain->road_pos_first = clamp(terrain->road_pos_first + pos_steps[i], -0.06f, 0.06f);
+			terrain->road_pos_zeroth += terrain->road_pos_first;
+
+			float max_offset = max(game_data::game_width / 2 - game_data::grass_min_left - terrain->road_size_zeroth / 2, 0.f);
+			terrain->road_pos_zeroth = clamp(terrain->road_pos_zeroth, -max_offset, max_offset);
+
+			row->tree = terrain->tree_cooldown-- <= 0 && randoms[stream_tree][i] < 0.05f;
+			if (row->tree) {
+				terrain->tree_cooldown = 40;
 
-	data->road_size_zeroth = clamp(data->road_size_zeroth, (float)game_data::road_min, (float)game_data::road_max);
+				float available_width = game_data::game_width - terrain->road_size_zeroth - 8.f;
+				float width = -game_data::game_width / 2.f + randoms[stream_tree_pos][i] * available_width + 2.f;
+				if (width > terrain->road_pos_zeroth - terrain->road_size_zeroth / 2.f - 2.f)
+					width += terrain->road_size_zeroth + 4.f;
 
-	opt = random_float(data->random_seed);
-	data->road_pos_first += (opt > 0.8f ? 1 : opt < 0.2f ? -1 : 0) * 0.02f;
-	data->road_pos_first = clamp(data->road_pos_first, -0.06f, 0.06f);
-	data->road_pos_zeroth += data->road_pos_first;
+				row->tree_x = width;
+			}
+
+			row->puddle = terrain->puddle_cooldown-- <= 0 && randoms[stream_puddle][i] < 0.01f;
+			if (row->puddle) {
+				terrain->puddle_cooldown = 60;
+				float min_width = terrain->road_size_zeroth / 2.f - 3.f;
+				row->puddle_x = 2.f * (randoms[stream_puddle_pos][i] - 0.5f) * min_width + terrain->road_pos_zeroth;
+			}
 
-	float max_offset = max(game_data::game_width / 2 - game_data::grass_min_left - data->road_size_zeroth / 2, 0.f);
-	data->road_pos_zeroth = clamp(data->road_pos_zeroth, -max_offset, max_offset);
+			row->box = terrain->box_cooldown-- <= 0 && randoms[stream_box][i] < 0.005f;
+			if (row->box) {
+				terrain->box_cooldown = 300;
+				float min_width = terrain->road_size_zeroth / 2.f - 3.f;
+				row->box_x = 2.f * (randoms[stream_box_pos][i] - 0.5f) * min_width + terrain->road_pos_zeroth;
+			}
 
-	coord pos = { data->road_pos_zeroth, (float)data->generation_pos };
-	data->entities[entity_grass].add(new grass(pos, data->road_size_zeroth, direction_left));
-	data->entities[entity_grass].add(new grass(pos, data->road_size_zeroth, direction_right));
+			row->terrain = *terrain;
+		}
+	}
 }
-void generate_cars(game_data* data)
+void generate_cars(game_data* data, long long row)
 {
-	if (data->car_cooldown-- <= 0 && random_float(data->random_seed) < 0.08f) {
+	if (data->car_cooldown-- <= 0 && random_float(data->random_seed, row, stream_car) < 0.08f) {
 		data->car_cooldown = 50;
 
 		size_t regular_count = data->entities[entity_regular_car].size();
@@ -991,7 +2372,7 @@ void generate_cars(game_data* data)
 		bool generate_enemy = false;
 
 		if (regular_count == enemy_count && regular_count < max_regular_count && enemy_count < max_enemy_count)
-			if (random_float(data->random_seed) <= 0.5f)
+			if (random_float(data->random_seed, row, stream_car_kind) <= 0.5f)
 				generate_regular = true;
 			else
 				generate_enemy = true;
@@ -1001,28 +2382,28 @@ void generate_cars(game_data* data)
 			generate_enemy = true;
 
 		if (generate_regular) {
-			float x_rand = random_float(data->random_seed);
-			float min_width = data->road_size_zeroth / 2.f - 6.f;
+			float x_rand = random_float(data->random_seed, row, stream_car_pos);
+			float min_width = data->terrain.road_size_zeroth / 2.f - 6.f;
 			float pos_x = 2.f * (x_rand - 0.5f) * min_width;
 
 			dynamic_array<sprites> anim;
 			anim.add(sprite_regular_car);
 			data->entities[entity_regular_car].add(new car(
-				{ pos_x + data->road_pos_zeroth,(float)data->generation_pos },
+				{ pos_x + data->terrain.road_pos_zeroth,(float)data->generation_pos },
 				{ 3, 2 }, move(anim), 1.f, 3.f));
 		}
 		else if (generate_enemy) {
-			float x_rand = random_float(data->random_seed);
-			float min_width = data->road_size_zeroth / 2.f - 6.f;
+			float x_rand = random_float(data->random_seed, row, stream_car_pos);
+			float min_width = data->terrain.road_size_zeroth / 2.f - 6.f;
 			float pos_x = 2.f * (x_rand - 0.5f) * min_width;
 
-			if (trap_count == 0 && (trap_count < tank_count || random_float(data->random_seed) <= 0.5f))
+			if (trap_count == 0 && (trap_count < tank_count || random_float(data->random_seed, row, stream_car_enemy) <= 0.5f))
 			{
 				dynamic_array<sprites> anim;
 				anim.add(sprite_trap_car0);
 				anim.add(sprite_trap_car1);
 				data->entities[entity_trap_car].add(new car(
-					{ pos_x + data->road_pos_zeroth,(float)data->generation_pos },
+					{ pos_x + data->terrain.road_pos_zeroth,(float)data->generation_pos },
 					{ 2.5f, 2 }, move(anim), 0.3f, 3.f, 10, game_data::trap_cooldown));
 			}
 			else
@@ -1030,7 +2411,7 @@ void generate_cars(game_data* data)
 				dynamic_array<sprites> anim;
 				anim.add(sprite_tank_car);
 				data->entities[entity_tank_car].add(new car(
-					{ pos_x + data->road_pos_zeroth,(float)data->generation_pos },
+					{ pos_x + data->terrain.road_pos_zeroth,(float)data->generation_pos },
 					{ 3, 3 }, move(anim), 1.f, 3.f, 20));
 			}
 		}
@@ -1038,52 +2419,140 @@ void generate_cars(game_data* data)
 			data->car_cooldown = 0;
 	}
 }
-void generate(game_data* data, bool should_generate_cars)
+class generation_worker
 {
-	int main_car_y_offset = (int)data->entities[entity_main_car][0]->position.y;
+public:
+	generation_worker()
+		:wake_(SDL_CreateSemaphore(0))
+	{
+		SDL_AtomicSet(&this->quit_, 0);
+	}
+	~generation_worker() noexcept
+	{
+		this->stop();
+		SDL_DestroySemaphore(this->wake_);
+	}
 
-	for (; data->generation_pos - main_car_y_offset < game_data::destroy_front; data->generation_pos++)
+	generation_worker(const generation_worker&) = delete;
+	generation_worker& operator=(const generation_worker&) = delete;
+
+	void start(unsigned long long seed, long long row, const terrain_state& terrain)
+	{
+		this->stop();
+
+		this->seed_ = seed;
+		this->row_ = row;
+		this->terrain_ = terrain;
+		this->chunks_.reset();
+
+		SDL_AtomicSet(&this->quit_, 0);
+		this->thread_ = SDL_CreateThread(worker_main, "generation", this);
+	}
+	void stop()
 	{
-		generate_road(data);
+		if (!this->thread_)
+			return;
 
-		if (data->tree_cooldown-- <= 0 && random_float(data->random_seed) < 0.05f) {
-			data->tree_cooldown = 40;
-			float x_rand = random_float(data->random_seed);
+		SDL_AtomicSet(&this->quit_, 1);
+		SDL_SemPost(this->wake_);
+		SDL_WaitThread(this->thread_, NULL);
+		this->thread_ = NULL;
+	}
 
-			float available_width = game_data::game_width - data->road_size_zeroth - 8.f;
-			float width = -game_data::game_width / 2.f + x_rand * available_width + 2.f;
-			if (width > data->road_pos_zeroth - data->road_size_zeroth / 2.f - 2.f)
-				width += data->road_size_zeroth + 4.f;
+	bool next(long long row, generated_row* generated)
+	{
+		while (const generated_chunk* chunk = this->chunks_.front()) {
+			if (row < chunk->first_row)
+				return false;
+
+			if (row < chunk->first_row + generated_chunk::rows_count) {
+				*generated = chunk->rows[row - chunk->first_row];
+				if (row == chunk->first_row + generated_chunk::rows_count - 1)
+					this->pop();
+				return true;
+			}
 
-			data->entities[entity_tree].add(new tree({ width, (float)data->generation_pos }));
+			this->pop();
 		}
+		return false;
+	}
 
-		if (data->puddle_cooldown-- <= 0 && random_float(data->random_seed) < 0.01f) {
-			data->puddle_cooldown = 60;
-			float x_rand = random_float(data->random_seed);
-			float min_width = data->road_size_zeroth / 2.f - 3.f;
-			float pos_x = 2.f * (x_rand - 0.5f) * min_width;
+private:
+	static constexpr size_t chunks_ahead = 8;
+
+	static int worker_main(void* ptr)
+	{
+		generation_worker* worker = (generation_worker*)ptr;
+
+		while (!SDL_AtomicGet(&worker->quit_)) {
+			generated_chunk* chunk = worker->chunks_.write_slot();
+			if (!chunk) {
+				SDL_SemWaitTimeout(worker->wake_, 100);
+				continue;
+			}
+
+			chunk->first_row = worker->row_;
+			generate_rows(worker->seed_, worker->row_, generated_chunk::rows_count, &worker->terrain_, chunk->rows);
+			worker->row_ += generated_chunk::rows_count;
 
-			data->entities[entity_puddle].add(new puddle({ pos_x + data->road_pos_zeroth,
-														 (float)data->generation_pos }));
+			worker->chunks_.push();
 		}
+		return 0;
+	}
 
-		if (data->box_cooldown-- <= 0 && random_float(data->random_seed) < 0.005f) {
-			data->box_cooldown = 300;
-			float x_rand = random_float(data->random_seed);
-			float min_width = data->road_size_zeroth / 2.f - 3.f;
-			float pos_x = 2.f * (x_rand - 0.5f) * min_width;
+	void pop()
+	{
+		this->chunks_.pop();
+		SDL_SemPost(this->wake_);
+	}
+
+	unsigned long long seed_;
+	long long row_;
+	terrain_state terrain_;
+
+	spsc_queue<generated_chunk, chunks_ahead> chunks_;
+	SDL_Thread* thread_ = NULL;
+	SDL_sem* wake_;
+	SDL_atomic_t quit_;
+};
+
+void splice_row(game_data* data, const generated_row& generated)
+{
+	data->terrain = generated.terrain;
+	float pos_y = (float)data->generation_pos;
+
+	coord pos = { data->terrain.road_pos_zeroth, pos_y };
+	data->entities[entity_grass].add(new grass(pos, data->terrain.road_size_zeroth, direction_left));
+	data->entities[entity_grass].add(new grass(pos, data->terrain.road_size_zeroth, direction_right));
+
+	if (generated.tree)
+		data->entities[entity_tree].add(new tree({ generated.tree_x, pos_y }));
+	if (generated.puddle)
+		data->entities[entity_puddle].add(new puddle({ generated.puddle_x, pos_y }));
+	if (generated.box)
+		data->entities[entity_box].add(new box({ generated.box_x, pos_y }));
+}
+void generate(game_data* data, generation_worker* generator, bool should_generate_cars)
+{
+	int main_car_y_offset = (int)data->entities[entity_main_car][0]->position.y;
 
-			data->entities[entity_box].add(new box({ pos_x + data->road_pos_zeroth,
-														 (float)data->generation_pos }));
+	for (; data->generation_pos - main_car_y_offset < game_data::destroy_front; data->generation_pos++)
+	{
+		long long row = data->origin + data->generation_pos;
+
+		generated_row generated;
+		if (!generator->next(row, &generated)) {
+			terrain_state terrain = data->terrain;
+			generate_rows(data->random_seed, row, 1, &terrain, &generated);
 		}
+		splice_row(data, generated);
 
 		if (should_generate_cars)
-			generate_cars(data);
+			generate_cars(data, row);
 	}
 }
 
-void update_generic_car(game_data* data, car* c, float delta, bool turn_left, bool turn_right)
+void update_generic_car(game_data* data, particle_pool* particles, car* c, float delta, bool turn_left, bool turn_right)
 {
 	car* main_car = (car*)data->entities[entity_main_car][0].get();
 	static constexpr float turn_speed = 60.f;
@@ -1100,7 +2569,7 @@ void update_generic_car(game_data* data, car* c, float delta, bool turn_left, bo
 
 	for (int i = 0; i < data->entities[entity_grass].size();)
 		if (c->collides(*data->entities[entity_grass][i])) {
-			c->destroy();
+			destroy_car(c, particles);
 			break;
 		}
 		else
@@ -1111,7 +2580,7 @@ void update_generic_car(game_data* data, car* c, float delta, bool turn_left, bo
 		if (b->lifetime > 0.f && c->collides(*b)) {
 			c->life--;
 			if (c->life <= 0)
-				c->destroy();
+				destroy_car(c, particles);
 			b->lifetime = 0.f;
 			break;
 		}
@@ -1125,14 +2594,14 @@ void update_generic_car(game_data* data, car* c, float delta, bool turn_left, bo
 				c->life -= 7;
 				c->explostion_invinc_time = game_data::bazooka_reload;
 				if (c->life <= 0)
-					c->destroy();
+					destroy_car(c, particles);
 				break;
 			}
 			else
 				i++;
 		}
 }
-void update_regular_cars(game_data* data, float delta)
+void update_regular_cars(game_data* data, particle_pool* particles, float delta)
 {
 	car* main_car = (car*)data->entities[entity_main_car][0].get();
 
@@ -1158,21 +2627,22 @@ void update_regular_cars(game_data* data, float delta)
 		else if (turn_dir == direction_right)
 			turn_right = true;
 
-		update_generic_car(data, c, delta, turn_left, turn_right);
+		update_generic_car(data, particles, c, delta, turn_left, turn_right);
 
 		if (c->invinc_time <= 0.f)
-			for (int i = entity_cars_first; i <= entity_cars_last; i++)
+			for (int i = entity_cars_first; i <= entity_cars_last && !c->destroyed; i++)
 				for (unique_ptr<entity>& e : data->entities[i]) {
 					car* other = (car*)e.get();
 					if (c != other && !other->destroyed && c->collides(*other) &&
 						!(other == main_car && data->car_state == running_state::enter)) {
-						c->destroy();
+						destroy_car(c, particles);
 						other->speed = min(c->speed * 0.8f, other->speed);
+						break;
 					}
 				}
 	}
 }
-void update_trap_cars(game_data* data, float delta)
+void update_trap_cars(game_data* data, particle_pool* particles, float delta)
 {
 	car* main_car = (car*)data->entities[entity_main_car][0].get();
 
@@ -1203,10 +2673,10 @@ void update_trap_cars(game_data* data, float delta)
 		else if (turn_dir == direction_right)
 			turn_right = true;
 
-		update_generic_car(data, c, delta, turn_left, turn_right);
+		update_generic_car(data, particles, c, delta, turn_left, turn_right);
 	}
 }
-void update_tank_cars(game_data* data, float delta)
+void update_tank_cars(game_data* data, particle_pool* particles, float delta)
 {
 	car* main_car = (car*)data->entities[entity_main_car][0].get();
 
@@ -1240,7 +2710,7 @@ void update_tank_cars(game_data* data, float delta)
 		else if (turn_dir == direction_right)
 			turn_right = true;
 
-		update_generic_car(data, c, delta, turn_left, turn_right);
+		update_generic_car(data, particles, c, delta, turn_left, turn_right);
 	}
 }
 
@@ -1254,14 +2724,14 @@ void update_main_car_enter(game_data* data)
 		pos_y = data->entities[entity_main_car][0]->position.y;
 	data->entities[entity_main_car] = dynamic_array<unique_ptr<entity>>();
 
-	float pos_x = data->road_pos_zeroth;
+	float pos_x = data->terrain.road_pos_zeroth;
 
 	dynamic_array<sprites> main_car_anim;
 	main_car_anim.add(sprite_main_car0);
 	main_car_anim.add(sprite_main_car1);
 	data->entities[entity_main_car].add(new car({ pos_x, pos_y }, { 3.f, 2.5f }, move(main_car_anim), 0.3f));
 }
-void update_main_car(game_data* data, float delta)
+void update_main_car(game_data* data, particle_pool* particles, float delta)
 {
 	bool infinite_lives = data->elapsed_time / 1000 < game_data::free_respawn_time;
 
@@ -1280,7 +2750,6 @@ void update_main_car(game_data* data, float delta)
 			}
 			else {
 				data->lives--;
-				save_score(data);
 				data->state = game_state::finished;
 			}
 		else
@@ -1307,6 +2776,9 @@ void update_main_car(game_data* data, float delta)
 		main_car->move_angle = 0.f;
 		if (move_left) main_car->move_angle -= 25.f;
 		if (move_right) main_car->move_angle += 25.f;
+
+		if (data->car_state != running_state::destroy && main_car->speed > 8.f && (move_left || move_right || deaccelerate))
+			emit_tyre_smoke(particles, main_car, delta);
 	}
 
 	if (main_car->position.y - data->last_dist_score_checkpoint > 50) {
@@ -1339,7 +2811,7 @@ void update_main_car(game_data* data, float delta)
 
 	data->car_state_left -= delta;
 }
-void update_main_car_collisions(game_data* data)
+void update_main_car_collisions(game_data* data, particle_pool* particles)
 {
 	car* main_car = (car*)(data->entities[entity_main_car][0].get());
 
@@ -1358,7 +2830,7 @@ void update_main_car_collisions(game_data* data)
 			data->entities[entity_trap].erase(data->entities[entity_trap].begin() + i);
 			data->car_state = running_state::destroy;
 			data->car_state_left = game_data::destroy_time;
-			main_car->destroy();
+			destroy_car(main_car, particles);
 			return;
 		}
 		else
@@ -1377,7 +2849,7 @@ void update_main_car_collisions(game_data* data)
 		if (main_car->collides(*data->entities[entity_grass][i])) {
 			data->car_state = running_state::destroy;
 			data->car_state_left = game_data::destroy_time;
-			main_car->destroy();
+			destroy_car(main_car, particles);
 			return;
 		}
 		else
@@ -1389,14 +2861,31 @@ void update_main_car_collisions(game_data* data)
 			if (!enemy->destroyed && main_car->collides(*enemy)) {
 				data->car_state = running_state::destroy;
 				data->car_state_left = game_data::destroy_time;
-				main_car->destroy();
+				destroy_car(main_car, particles);
 				return;
 			}
 			else
 				i++;
 		}
 }
-void update(game_data* data)
+void rebase_origin(game_data* data, particle_pool* particles)
+{
+	float main_car_pos = data->entities[entity_main_car][0]->position.y;
+	if (main_car_pos < game_data::origin_chunk)
+		return;
+
+	int offset = (int)(main_car_pos / game_data::origin_chunk) * game_data::origin_chunk;
+
+	for (int i = 0; i < entity_count; i++)
+		for (unique_ptr<entity>& e : data->entities[i])
+			e->position.y -= offset;
+	particles->offset({ 0.f, (float)-offset });
+
+	data->origin += offset;
+	data->generation_pos -= offset;
+	data->last_dist_score_checkpoint -= offset;
+}
+void update(game_data* data, job_system* jobs, generation_worker* generator, particle_pool* particles)
 {
 	if (data->state != game_state::running)
 		return;
@@ -1409,7 +2898,7 @@ void update(game_data* data)
 	float delta = frame_diff / 1000.f;
 
 	car* main_car = (car*)(data->entities[entity_main_car][0].get());
-	update_main_car(data, delta);
+	update_main_car(data, particles, delta);
 
 	if (data->car_state == running_state::enter)
 		main_car->render_position_offset.y = min(1.f - (data->car_state_left / game_data::enter_time) * 
@@ -1418,22 +2907,29 @@ void update(game_data* data)
 		main_car->render_position_offset.y = 0.f;
 
 	if (data->car_state != running_state::destroy && data->car_state != running_state::enter)
-		update_main_car_collisions(data);
+		update_main_car_collisions(data, particles);
 
-	update_regular_cars(data, delta);
-	update_tank_cars(data, delta);
-	update_trap_cars(data, delta);
+	update_regular_cars(data, particles, delta);
+	update_tank_cars(data, particles, delta);
+	update_trap_cars(data, particles, delta);
 
-	for (int i = 0; i < entity_count; i++)
-		for (unique_ptr<entity>& e : data->entities[i])
-			e->update(delta);
+	for (int i = 0; i < entity_count; i++) {
+		dynamic_array<unique_ptr<entity>>& stream = data->entities[i];
+		jobs->parallel_for(0, stream.size(), game_data::update_grain, [&](size_t begin, size_t end) {
+			for (size_t j = begin; j < end; j++)
+				stream[j]->update(delta);
+		});
+	}
+	particles->update(delta, game_data::particle_drag);
 
-	generate(data, true);
-	clean_entities(data);
+	generate(data, generator, true);
+	clean_entities(data, particles);
+	rebase_origin(data, particles);
 }
 
-void new_game(game_data* data)
+void new_game(game_data* data, generation_worker* generator, particle_pool* particles)
 {
+	particles->clear();
 	data->state = game_state::running;
 	for (int i = 0; i < entity_count; i++)
 		data->entities[i] = dynamic_array<unique_ptr<entity>>();
@@ -1447,24 +2943,26 @@ void new_game(game_data* data)
 	data->lives = 0;
 	data->last_life_checkpoint = 0;
 
-	data->tree_cooldown = 50;
-	data->puddle_cooldown = 50;
-	data->box_cooldown = 400;
 	data->car_cooldown = 0;
 	data->bullet_cooldown = 0.f;
 	data->bazooka_left = 0;
 
-	data->road_size_zeroth = 0.f;
-	data->road_size_first = 0.f;
-	data->road_pos_zeroth = 0.f;
-	data->road_pos_first = 0.f;
+	data->terrain.tree_cooldown = 50;
+	data->terrain.puddle_cooldown = 50;
+	data->terrain.box_cooldown = 400;
+	data->terrain.road_size_zeroth = 0.f;
+	data->terrain.road_size_first = 0.f;
+	data->terrain.road_pos_zeroth = 0.f;
+	data->terrain.road_pos_first = 0.f;
 
 	data->car_state = running_state::destroy;
 	data->car_state_left = 0.f;
-	update_main_car(data, 0.f);
+	update_main_car(data, particles, 0.f);
 
+	data->origin = 0;
 	data->generation_pos = -game_data::destroy_back;
-	generate(data, false);
+	generator->start(data->random_seed, data->origin + data->generation_pos, data->terrain);
+	generate(data, generator, false);
 }
 
 void get_file_path(char** path);
@@ -1502,7 +3000,7 @@ void save_game(game_data* data)
 
 	fclose(file);
 }
-void load_game(game_data* data)
+void load_game(game_data* data, generation_worker* generator, particle_pool* particles)
 {
 	char* path = NULL;
 	get_file_path(&path);
@@ -1519,7 +3017,9 @@ void load_game(game_data* data)
 	{
 		fread(text_check, sizeof(game_data::save_file_prefix), 1, file);
 
-		if (strcmp(text_check, game_data::save_file_prefix) == 0)
+		if (memcmp(text_check, game_data::save_file_prefix, sizeof(game_data::save_file_prefix)) != 0)
+			printf("%s is not a save file of this version.\n", path);
+		else
 		{
 			fread(data, sizeof(*data) - sizeof(game_data::entities), 1, file);
 			for (int i = 0; i < entity_count; i++) {
@@ -1544,6 +3044,8 @@ void load_game(game_data* data)
 					data->entities[i][j] = unique_ptr<entity>(loaded_entity);
 				}
 			}
+			generator->start(data->random_seed, data->origin + data->generation_pos, data->terrain);
+			particles->clear();
 		}
 		fclose(file);
 	}
@@ -1582,23 +3084,264 @@ void update_game_state(game_data* data, Uint32 input_type)
 			break;
 	}
 }
+struct render_thread_data
+{
+	screen_type* screen = nullptr;
+	triple_buffer<render_frame>* frames = nullptr;
+	SDL_sem* ready = NULL;
+	bool started = false;
+	bool report_culling = false;
+	FILE* dump = NULL;
+	FILE* replay = NULL;
+	frame_capture* capture = nullptr;
+	job_system* jobs = nullptr;
+	leaderboard* scores = nullptr;
+	SDL_atomic_t failed = {};
+	SDL_atomic_t replayed = {};
+
+	float frame_rate = game_data::frame_rate;
+	float min_scale = 1.f;
+	float max_scale = 1.f;
+	upscale_filter filter = upscale_linear;
+};
+void replay_frames(render_data_type* render_data, FILE* file)
+{
+	unique_ptr<render_frame> frame(new render_frame());
+	unsigned long frames = 0;
+	size_t commands = 0;
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	while (frame->load(file)) {
+		draw(*render_data, *frame);
+		if (render_data->capture)
+			render_data->capture->capture(render_data->screen);
+		render_data->screen->update();
+		frames++;
+		commands += frame->commands.size();
+	}
+	double elapsed = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+	if (frames != 0)
+		printf("Replayed %lu frames (%zu commands) in %.3f s, %.3f ms per frame.\n", 
+			   frames, commands, elapsed, elapsed * 1000.0 / frames);
+}
+void run_renderer(render_thread_data* thread_data)
+{
+	render_data_type render_data;
+	render_data.screen = thread_data->screen;
+	render_data.report_culling = thread_data->report_culling;
+	render_data.capture = thread_data->capture;
+	render_data.scores = thread_data->scores;
+	load_textures(&render_data, thread_data->jobs);
+	render_data.background.create(render_data.screen);
+	render_data.hud.create(render_data.screen, &render_data.font);
+	render_data.scene.create(render_data.screen, thread_data->min_scale, thread_data->max_scale, 
+							 thread_data->filter, thread_data->frame_rate);
+	thread_data->started = true;
+	SDL_SemPost(thread_data->ready);
+
+	if (thread_data->replay) {
+		replay_frames(&render_data, thread_data->replay);
+		SDL_AtomicSet(&thread_data->replayed, 1);
+		return;
+	}
+
+	while (const render_frame* frame = thread_data->frames->acquire()) {
+		if (thread_data->dump)
+			frame->save(thread_data->dump);
+		Uint64 start = SDL_GetPerformanceCounter();
+		draw(render_data, *frame);
+		render_data.scene.measure(SDL_GetPerformanceCounter() - start);
+
+		if (render_data.capture)
+			render_data.capture->capture(render_data.screen);
+		render_data.screen->update();
+	}
+}
+int render_thread(void* ptr)
+{
+	render_thread_data* thread_data = (render_thread_data*)ptr;
+
+	try {
+		thread_data->screen->create_renderer();
+		run_renderer(thread_data);
+	}
+	catch (int) {
+		SDL_AtomicSet(&thread_data->failed, 1);
+		if (!thread_data->started)
+			SDL_SemPost(thread_data->ready);
+	}
+
+	thread_data->screen->destroy_renderer();
+	return SDL_AtomicGet(&thread_data->failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int SDL_main(int argc, char* argv[])
 {
+	float frame_rate = game_data::frame_rate;
+	bool vsync = true;
+	bool report_culling = false;
+	bool software = false;
+	bool offscreen = false;
+	float min_scale = 0.5f;
+	float max_scale = 1.f;
+	upscale_filter filter = upscale_linear;
+	const char* dump_path = NULL;
+	const char* replay_path = NULL;
+	const char* capture_path = NULL;
+	const char* pack_path = NULL;
+	const char* import_path = NULL;
+	for (int i = 1; i < argc; i++)
+		if (strncmp(argv[i], "--fps=", 6) == 0)
+			frame_rate = clamp((float)atof(argv[i] + 6), game_data::idle_frame_rate, 1000.f);
+		else if (strcmp(argv[i], "--no-vsync") == 0)
+			vsync = false;
+		else if (strcmp(argv[i], "--cull-stats") == 0)
+			report_culling = true;
+		else if (strcmp(argv[i], "--software") == 0)
+			software = true;
+		else if (strcmp(argv[i], "--offscreen") == 0)
+			offscreen = true;
+		else if (strncmp(argv[i], "--dump-commands=", 16) == 0)
+			dump_path = argv[i] + 16;
+		else if (strncmp(argv[i], "--replay-commands=", 18) == 0)
+			replay_path = argv[i] + 18;
+		else if (strncmp(argv[i], "--capture=", 10) == 0)
+			capture_path = argv[i] + 10;
+		else if (strncmp(argv[i], "--pack-assets=", 14) == 0)
+			pack_path = argv[i] + 14;
+		else if (strncmp(argv[i], "--import-scores=", 16) == 0)
+			import_path = argv[i] + 16;
+		else if (strncmp(argv[i], "--min-scale=", 12) == 0)
+			min_scale = clamp((float)atof(argv[i] + 12), 0.25f, 1.f);
+		else if (strncmp(argv[i], "--max-scale=", 12) == 0)
+			max_scale = clamp((float)atof(argv[i] + 12), 0.25f, 1.f);
+		else if (strcmp(argv[i], "--upscale=integer") == 0)
+			filter = upscale_integer;
+		else if (strcmp(argv[i], "--upscale=linear") == 0)
+			filter = upscale_linear;
+	min_scale = min(min_scale, max_scale);
+
 	unique_ptr<stdout_redirect> redirect(new stdout_redirect("output.txt"));
-	unique_ptr<screen_type> screen(new screen_type("SpyHunter", 640, 480));
-	unique_ptr<font_type> font(new font_type("cs8x8.bmp", screen->renderer));
+	if (pack_path) {
+		unique_ptr<job_system> jobs(new job_system(max(SDL_GetCPUCount() - 1, 1)));
+		SDL_Surface* surfaces[assets_count];
+		decode_assets(surfaces, jobs.get());
+
+		bool written = asset_pack::write(pack_path, surfaces, assets_count);
+		for (SDL_Surface* surface : surfaces)
+			SDL_FreeSurface(surface);
+
+		if (!written) {
+			printf("Cannot write asset pack %s.\n", pack_path);
+			throw EXIT_FAILURE;
+		}
+		printf("Wrote %i images to %s.\n", assets_count, pack_path);
+		return EXIT_SUCCESS;
+	}
+	if (offscreen && !replay_path) {
+		printf("--offscreen requires --replay-commands.\n");
+		throw EXIT_FAILURE;
+	}
+	unique_ptr<screen_type> screen(new screen_type("SpyHunter", 640, 480, vsync, software, offscreen));
+
+	unique_ptr<triple_buffer<render_frame>> frames(new triple_buffer<render_frame>());
+	render_thread_data thread_data;
+	thread_data.screen = screen.get();
+	thread_data.frames = frames.get();
+	thread_data.ready = SDL_CreateSemaphore(0);
+	thread_data.report_culling = report_culling;
+	if (dump_path) {
+		if (fopen_s(&thread_data.dump, dump_path, "wb") != 0) {
+			printf("Cannot open %s for dump.\n", dump_path);
+			throw EXIT_FAILURE;
+		}
+		render_frame::save_header(thread_data.dump);
+	}
+	if (replay_path) {
+		if (fopen_s(&thread_data.replay, replay_path, "rb") != 0) {
+			printf("Cannot open %s for replay.\n", replay_path);
+			throw EXIT_FAILURE;
+		}
+		if (!render_frame::load_header(thread_data.replay)) {
+			printf("%s is not a command dump of this version.\n", replay_path);
+			fclose(thread_data.replay);
+			throw EXIT_FAILURE;
+		}
+	}
+
+	unique_ptr<frame_capture> capture;
+	if (capture_path) {
+		size_t length = strlen(capture_path);
+		capture_format format = length >= 4 && strcmp(capture_path + length - 4, ".y4m") == 0 ? capture_y4m : capture_raw_rgb;
+		capture = new frame_capture(capture_path, format, screen->width, screen->height, (int)frame_rate, replay_path == NULL);
+		thread_data.capture = capture.get();
+	}
+
+	unique_ptr<job_system> jobs(new job_system(max(SDL_GetCPUCount() - 1, 1)));
+	thread_data.jobs = jobs.get();
+
+	unique_ptr<score_store> store(new score_store());
+	if (!store->open(game_data::scores_file, game_data::score_names_file)) {
+		int imported = store->import_text(game_data::legacy_scores_file);
+		if (imported != 0)
+			printf("Imported %i scores from %s.\n", imported, game_data::legacy_scores_file);
+	}
+	if (import_path)
+		printf("Imported %i scores from %s.\n", store->import_text(import_path), import_path);
+
+	unique_ptr<leaderboard> scores(new leaderboard());
+	scores->load(*store);
+	thread_data.scores = scores.get();
+	thread_data.frame_rate = frame_rate;
+	thread_data.min_scale = min_scale;
+	thread_data.max_scale = max_scale;
+	thread_data.filter = filter;
+
+	SDL_Thread* renderer = SDL_CreateThread(render_thread, "render", &thread_data);
+	SDL_SemWait(thread_data.ready);
+	SDL_DestroySemaphore(thread_data.ready);
+
+	if (SDL_AtomicGet(&thread_data.failed)) {
+		SDL_WaitThread(renderer, NULL);
+		throw EXIT_FAILURE;
+	}
+
+	if (thread_data.replay) {
+		while (!SDL_AtomicGet(&thread_data.replayed) && !SDL_AtomicGet(&thread_data.failed)) {
+			SDL_PumpEvents();
+			SDL_Delay(10);
+		}
+		SDL_WaitThread(renderer, NULL);
+		fclose(thread_data.replay);
+		if (SDL_AtomicGet(&thread_data.failed))
+			throw EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
+	unique_ptr<generation_worker> generator(new generation_worker());
 
 	unique_ptr<game_data> data(new game_data());
-	new_game(data.get());
+	unique_ptr<particle_pool> particles(new particle_pool(game_data::particles_capacity));
+	new_game(data.get(), generator.get(), particles.get());
 
-	render_data_type render_data = { screen.get(), data.get(), font.get() };
-	load_textures(render_data.textures, screen.get());
+	frame_scheduler scheduler(frame_rate);
+	camera view;
 
 	while (data->state != game_state::quit)
 	{
-		update(data.get());
-		draw(render_data);
-		screen->update();
+		if (SDL_AtomicGet(&thread_data.failed)) {
+			printf("Renderer stopped, quitting.\n");
+			break;
+		}
+		scheduler.set_target_rate(data->state == game_state::running ? frame_rate : game_data::idle_frame_rate);
+
+		game_state previous_state = data->state;
+		update(data.get(), jobs.get(), generator.get(), particles.get());
+		if (previous_state == game_state::running && data->state == game_state::finished)
+			save_score(data.get(), store.get(), scores.get());
+		build_frame(data.get(), particles.get(), screen.get(), &view, &frames->write_buffer());
+		frames->publish();
 
 		SDL_Event event;
 		while (SDL_PollEvent(&event)) {
@@ -1607,16 +3350,18 @@ int SDL_main(int argc, char* argv[])
 					switch (event.key.keysym.sym)
 					{
 						case SDLK_ESCAPE: data->state = game_state::quit; break;
-						case SDLK_n: new_game(data.get()); break;
+						case SDLK_n: new_game(data.get(), generator.get(), particles.get()); break;
 						case SDLK_p: case SDLK_t: case SDLK_y: update_game_state(data.get(), event.key.keysym.sym); break;
 						case SDLK_s: if (data->state == game_state::running) save_game(data.get()); 
 							data->last_frame_time = SDL_GetTicks(); break;
-						case SDLK_l: load_game(data.get()); data->last_frame_time = SDL_GetTicks(); break;
+						case SDLK_l: load_game(data.get(), generator.get(), particles.get()); data->last_frame_time = SDL_GetTicks(); break;
 						case SDLK_UP: data->arrows[direction_up] = true; break;
 						case SDLK_DOWN: data->arrows[direction_down] = true; break;
 						case SDLK_LEFT: data->arrows[direction_left] = true; break;
 						case SDLK_RIGHT: data->arrows[direction_right] = true; break;
 						case SDLK_SPACE: data->shooting = true; break;
+						case SDLK_EQUALS: case SDLK_KP_PLUS: view.zoom_in(); break;
+						case SDLK_MINUS: case SDLK_KP_MINUS: view.zoom_out(); break;
 					}
 					break;
 				case SDL_KEYUP:
@@ -1629,12 +3374,31 @@ int SDL_main(int argc, char* argv[])
 						case SDLK_SPACE: data->shooting = false; break;
 					}
 					break;
+				case SDL_WINDOWEVENT:
+					if (event.window.event == SDL_WINDOWEVENT_EXPOSED)
+						SDL_AtomicSet(&screen->exposed, 1);
+					else if (event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+						SDL_AtomicSet(&screen->size_changed, 1);
+					break;
+				case SDL_RENDER_TARGETS_RESET:
+				case SDL_RENDER_DEVICE_RESET:
+					SDL_AtomicSet(&screen->targets_reset, 1);
+					break;
 				case SDL_QUIT:
 					data->state = game_state::quit;
 					break;
 			};
 		};
+
+		scheduler.wait();
 	};
 
+	frames->close();
+	SDL_WaitThread(renderer, NULL);
+	if (thread_data.dump)
+		fclose(thread_data.dump);
+
+	if (SDL_AtomicGet(&thread_data.failed))
+		throw EXIT_FAILURE;
 	return EXIT_SUCCESS;
 };
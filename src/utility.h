@@ -6,6 +6,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#endif
+
 extern "C" {
 #include "../SDL2-2.0.10/include/SDL.h"
 #include "../SDL2-2.0.10/include/SDL_main.h"
@@ -209,6 +218,10 @@ public:
 		this->size_--;
 	}
 
+	void clear() noexcept
+	{
+		this->size_ = 0;
+	}
 	void resize(size_t new_size)
 	{
 		this->reallocate(new_size);
@@ -237,6 +250,10 @@ public:
 	{
 		return this->data_[i];
 	}
+	const Type& operator[](size_t i) const
+	{
+		return this->data_[i];
+	}
 
 private:
 	Type* data_ = nullptr;
@@ -284,16 +301,237 @@ struct color
 	unsigned char r, g, b, a;
 };
 
-inline float random_float(unsigned long long& state) noexcept
+inline unsigned int hash_uint(unsigned int x) noexcept
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+inline unsigned int random_key(unsigned long long seed, unsigned int stream) noexcept
+{
+	return hash_uint((unsigned int)seed ^ hash_uint((unsigned int)(seed >> 32) + stream * 0x9e3779b9u));
+}
+inline unsigned int random_uint(unsigned int key, long long counter) noexcept
+{
+	return hash_uint(hash_uint((unsigned int)counter ^ key) + (unsigned int)((unsigned long long)counter >> 32));
+}
+inline float random_float(unsigned long long seed, long long counter, unsigned int stream) noexcept
+{
+	return (random_uint(random_key(seed, stream), counter) >> 8) * (1.f / 16777216.f);
+}
+
+#if defined(SIMD_AVX2)
+inline __m256i hash_uint(__m256i x) noexcept
+{
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0x846ca68bu));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	return x;
+}
+#elif defined(SIMD_SSE2)
+inline __m128i mullo_epi32(__m128i a, __m128i b) noexcept
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+							  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+inline __m128i hash_uint(__m128i x) noexcept
+{
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	x = mullo_epi32(x, _mm_set1_epi32(0x7feb352d));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+	x = mullo_epi32(x, _mm_set1_epi32((int)0x846ca68bu));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	return x;
+}
+inline __m128 random_float(__m128i key, long long counter) noexcept
+{
+	unsigned long long c = (unsigned long long)counter;
+	__m128i low = _mm_set_epi32((int)(c + 3), (int)(c + 2), (int)(c + 1), (int)c);
+	__m128i high = _mm_set_epi32((int)((c + 3) >> 32), (int)((c + 2) >> 32), (int)((c + 1) >> 32), (int)(c >> 32));
+	__m128i result = hash_uint(_mm_add_epi32(hash_uint(_mm_xor_si128(low, key)), high));
+	return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(result, 8)), _mm_set1_ps(1.f / 16777216.f));
+}
+#endif
+
+inline void random_floats(unsigned long long seed, long long first, unsigned int stream, int count, float* out) noexcept
 {
-	unsigned long long oldstate = state;
-	state = oldstate * 6364136223846793005ULL + 1442695040888963407ULL;
-	unsigned long xorshifted = static_cast<unsigned long>(((oldstate >> 18u) ^ oldstate) >> 27u);
-	long rot = static_cast<long>(oldstate >> 59u);
-	unsigned long result = (xorshifted >> rot) | (xorshifted << (32 - rot));
-	return (float)result / 0xffffffff;
+	unsigned int key = random_key(seed, stream);
+	int i = 0;
+
+#if defined(SIMD_AVX2)
+	__m256i keys = _mm256_set1_epi32((int)key);
+	for (; i + 8 <= count; i += 8) {
+		unsigned long long c = (unsigned long long)(first + i);
+		__m256i low = _mm256_add_epi32(_mm256_set1_epi32((int)c), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		__m256i high = _mm256_setr_epi32((int)(c >> 32), (int)((c + 1) >> 32), (int)((c + 2) >> 32), (int)((c + 3) >> 32),
+										 (int)((c + 4) >> 32), (int)((c + 5) >> 32), (int)((c + 6) >> 32), (int)((c + 7) >> 32));
+		__m256i result = hash_uint(_mm256_add_epi32(hash_uint(_mm256_xor_si256(low, keys)), high));
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(result, 8)),
+												_mm256_set1_ps(1.f / 16777216.f)));
+	}
+#elif defined(SIMD_SSE2)
+	__m128i keys = _mm_set1_epi32((int)key);
+	for (; i + 8 <= count; i += 8) {
+		_mm_storeu_ps(out + i, random_float(keys, first + i));
+		_mm_storeu_ps(out + i + 4, random_float(keys, first + i + 4));
+	}
+#endif
+
+	for (; i < count; i++)
+		out[i] = (random_uint(key, first + i) >> 8) * (1.f / 16777216.f);
 }
 
+class particle_pool
+{
+public:
+	explicit particle_pool(size_t capacity, unsigned long long seed = 0)
+		:x_(capacity), y_(capacity), vx_(capacity), vy_(capacity), life_(capacity), inv_lifetime_(capacity),
+		 sizes_(capacity), kinds_(capacity), capacity_(capacity), key_(random_key(seed, 0))
+	{
+	}
+
+	particle_pool(const particle_pool&) = delete;
+	particle_pool& operator=(const particle_pool&) = delete;
+
+	bool emit(coord position, coord velocity, float lifetime, float size, Uint8 kind)
+	{
+		if (this->count_ == this->capacity_ || lifetime <= 0.f)
+			return false;
+
+		size_t i = this->count_++;
+		this->x_[i] = position.x;
+		this->y_[i] = position.y;
+		this->vx_[i] = velocity.x;
+		this->vy_[i] = velocity.y;
+		this->life_[i] = lifetime;
+		this->inv_lifetime_[i] = 1.f / lifetime;
+		this->sizes_[i] = size;
+		this->kinds_[i] = kind;
+		return true;
+	}
+
+	void update(float delta, float drag)
+	{
+		float* x = this->x_.begin();
+		float* y = this->y_.begin();
+		float* vx = this->vx_.begin();
+		float* vy = this->vy_.begin();
+		float* life = this->life_.begin();
+		float damping = expf(-drag * delta);
+		size_t i = 0;
+
+#if defined(SIMD_AVX2)
+		__m256 delta8 = _mm256_set1_ps(delta);
+		__m256 damping8 = _mm256_set1_ps(damping);
+		for (; i + 8 <= this->count_; i += 8) {
+			__m256 vx8 = _mm256_loadu_ps(vx + i);
+			__m256 vy8 = _mm256_loadu_ps(vy + i);
+			_mm256_storeu_ps(x + i, _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_mul_ps(vx8, delta8)));
+			_mm256_storeu_ps(y + i, _mm256_add_ps(_mm256_loadu_ps(y + i), _mm256_mul_ps(vy8, delta8)));
+			_mm256_storeu_ps(vx + i, _mm256_mul_ps(vx8, damping8));
+			_mm256_storeu_ps(vy + i, _mm256_mul_ps(vy8, damping8));
+			_mm256_storeu_ps(life + i, _mm256_sub_ps(_mm256_loadu_ps(life + i), delta8));
+		}
+#elif defined(SIMD_SSE2)
+		__m128 delta4 = _mm_set1_ps(delta);
+		__m128 damping4 = _mm_set1_ps(damping);
+		for (; i + 4 <= this->count_; i += 4) {
+			__m128 vx4 = _mm_loadu_ps(vx + i);
+			__m128 vy4 = _mm_loadu_ps(vy + i);
+			_mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_mul_ps(vx4, delta4)));
+			_mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(vy4, delta4)));
+			_mm_storeu_ps(vx + i, _mm_mul_ps(vx4, damping4));
+			_mm_storeu_ps(vy + i, _mm_mul_ps(vy4, damping4));
+			_mm_storeu_ps(life + i, _mm_sub_ps(_mm_loadu_ps(life + i), delta4));
+		}
+#endif
+
+		for (; i < this->count_; i++) {
+			x[i] += vx[i] * delta;
+			y[i] += vy[i] * delta;
+			vx[i] *= damping;
+			vy[i] *= damping;
+			life[i] -= delta;
+		}
+
+		for (size_t j = 0; j < this->count_;)
+			if (life[j] <= 0.f)
+				this->remove(j);
+			else
+				j++;
+	}
+
+	void offset(coord by)
+	{
+		for (size_t i = 0; i < this->count_; i++) {
+			this->x_[i] += by.x;
+			this->y_[i] += by.y;
+		}
+	}
+	void clear() noexcept
+	{
+		this->count_ = 0;
+	}
+
+	float random() noexcept
+	{
+		return (random_uint(this->key_, this->counter_++) >> 8) * (1.f / 16777216.f);
+	}
+
+	size_t size() const noexcept
+	{
+		return this->count_;
+	}
+	coord position(size_t i) const noexcept
+	{
+		return { this->x_[i], this->y_[i] };
+	}
+	float age(size_t i) const noexcept
+	{
+		return 1.f - this->life_[i] * this->inv_lifetime_[i];
+	}
+	float size(size_t i) const noexcept
+	{
+		return this->sizes_[i];
+	}
+	Uint8 kind(size_t i) const noexcept
+	{
+		return this->kinds_[i];
+	}
+
+private:
+	void remove(size_t i) noexcept
+	{
+		size_t last = --this->count_;
+		this->x_[i] = this->x_[last];
+		this->y_[i] = this->y_[last];
+		this->vx_[i] = this->vx_[last];
+		this->vy_[i] = this->vy_[last];
+		this->life_[i] = this->life_[last];
+		this->inv_lifetime_[i] = this->inv_lifetime_[last];
+		this->sizes_[i] = this->sizes_[last];
+		this->kinds_[i] = this->kinds_[last];
+	}
+
+	dynamic_array<float> x_, y_;
+	dynamic_array<float> vx_, vy_;
+	dynamic_array<float> life_, inv_lifetime_;
+	dynamic_array<float> sizes_;
+	dynamic_array<Uint8> kinds_;
+	size_t count_ = 0;
+	size_t capacity_;
+
+	unsigned int key_;
+	long long counter_ = 0;
+};
+
 class stdout_redirect
 {
 public:
@@ -311,143 +549,1220 @@ private:
 	FILE* output_;
 };
 
-struct screen_type
+struct job_counter;
+
+struct job
+{
+	void (*function)(void* context, size_t begin, size_t end);
+	void* context;
+	size_t begin;
+	size_t end;
+	job_counter* counter;
+};
+
+struct job_counter
 {
-	screen_type(const char* title, int width, int height)
-		:width(width), height(height)
+	job_counter() noexcept
 	{
-		if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
-			printf("SDL_Init error: %s.\n", SDL_GetError());
-			throw EXIT_FAILURE;
+		SDL_AtomicSet(&this->pending, 0);
+	}
+
+	job_counter(const job_counter&) = delete;
+	job_counter& operator=(const job_counter&) = delete;
+
+	SDL_atomic_t pending;
+	SDL_SpinLock lock = 0;
+	dynamic_array<job> continuations;
+};
+
+class job_deque
+{
+public:
+	static constexpr size_t capacity = 1024;
+
+	bool push(const job& to_push) noexcept
+	{
+		SDL_AtomicLock(&this->lock_);
+		bool pushed = this->bottom_ - this->top_ < capacity;
+		if (pushed)
+			this->jobs_[this->bottom_++ % capacity] = to_push;
+		SDL_AtomicUnlock(&this->lock_);
+		return pushed;
+	}
+	bool pop(job* popped) noexcept
+	{
+		SDL_AtomicLock(&this->lock_);
+		bool found = this->bottom_ != this->top_;
+		if (found)
+			*popped = this->jobs_[--this->bottom_ % capacity];
+		SDL_AtomicUnlock(&this->lock_);
+		return found;
+	}
+	bool steal(job* stolen) noexcept
+	{
+		SDL_AtomicLock(&this->lock_);
+		bool found = this->bottom_ != this->top_;
+		if (found)
+			*stolen = this->jobs_[this->top_++ % capacity];
+		SDL_AtomicUnlock(&this->lock_);
+		return found;
+	}
+
+private:
+	job jobs_[capacity];
+	size_t top_ = 0;
+	size_t bottom_ = 0;
+	SDL_SpinLock lock_ = 0;
+};
+
+class job_system
+{
+public:
+	explicit job_system(int worker_count)
+		:worker_count_(worker_count), deques_(new job_deque[worker_count + 1]),
+		threads_(new SDL_Thread*[worker_count]), thread_ids_(new SDL_threadID[worker_count + 1]),
+		workers_(new worker_data[worker_count]), wake_(SDL_CreateSemaphore(0))
+	{
+		SDL_AtomicSet(&this->quit_, 0);
+		this->thread_ids_[0] = SDL_ThreadID();
+
+		SDL_sem* started = SDL_CreateSemaphore(0);
+		for (int i = 0; i < worker_count; i++) {
+			this->workers_[i] = { this, i + 1, started };
+			this->threads_[i] = SDL_CreateThread(worker_main, "worker", &this->workers_[i]);
 		}
+		for (int i = 0; i < worker_count; i++)
+			SDL_SemWait(started);
+		SDL_DestroySemaphore(started);
+	}
+	~job_system() noexcept
+	{
+		SDL_AtomicSet(&this->quit_, 1);
+		for (int i = 0; i < this->worker_count_; i++)
+			SDL_SemPost(this->wake_);
+		for (int i = 0; i < this->worker_count_; i++)
+			SDL_WaitThread(this->threads_[i], NULL);
 
-		if (SDL_CreateWindowAndRenderer(this->width, this->height, 0, &this->window, &this->renderer) != 0) {
-			SDL_Quit();
-			printf("SDL_CreateWindowAndRenderer error: %s.\n", SDL_GetError());
-			throw EXIT_FAILURE;
-		};
+		SDL_DestroySemaphore(this->wake_);
+		delete[] this->workers_;
+		delete[] this->thread_ids_;
+		delete[] this->threads_;
+		delete[] this->deques_;
+	}
 
-		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
-		SDL_RenderSetLogicalSize(this->renderer, this->width, this->height);
-		SDL_SetRenderDrawBlendMode(this->renderer, SDL_BLENDMODE_BLEND);
+	job_system(const job_system&) = delete;
+	job_system& operator=(const job_system&) = delete;
 
-		SDL_SetWindowTitle(this->window, title);
+	int worker_count() const noexcept
+	{
+		return this->worker_count_;
 	}
-	~screen_type() noexcept
+
+	void run(void (*function)(void*, size_t, size_t), void* context, size_t begin, size_t end,
+			 job_counter* counter, job_counter* dependency = nullptr)
 	{
-		SDL_DestroyRenderer(this->renderer);
-		SDL_DestroyWindow(this->window);
+		job to_run = { function, context, begin, end, counter };
+		if (counter)
+			SDL_AtomicAdd(&counter->pending, 1);
 
-		SDL_Quit();
+		if (dependency) {
+			SDL_AtomicLock(&dependency->lock);
+			bool deferred = SDL_AtomicGet(&dependency->pending) != 0;
+			if (deferred)
+				dependency->continuations.add(to_run);
+			SDL_AtomicUnlock(&dependency->lock);
+
+			if (deferred)
+				return;
+		}
+
+		this->push(to_run);
+	}
+	template<typename Function>
+	void run(const Function& function, job_counter* counter, job_counter* dependency = nullptr)
+	{
+		this->run(&invoke_task<Function>, new Function(function), 0, 1, counter, dependency);
 	}
 
-	screen_type(const screen_type&) = delete;
-	screen_type(screen_type&&) = delete;
-	screen_type& operator=(const screen_type&) = delete;
-	screen_type& operator=(screen_type&&) = delete;
+	void wait(job_counter* counter)
+	{
+		int index = this->current_index();
+		while (SDL_AtomicGet(&counter->pending) != 0) {
+			job found;
+			if (this->find(index, &found))
+				this->execute(found);
+			else
+				SDL_Delay(0);
+		}
 
-	void update()
+		SDL_AtomicLock(&counter->lock);
+		SDL_AtomicUnlock(&counter->lock);
+	}
+
+	template<typename Function>
+	void parallel_for(size_t begin, size_t end, size_t grain, const Function& function)
 	{
-		SDL_RenderPresent(this->renderer);
-		SDL_SetRenderDrawColor(this->renderer, 0, 0, 0, 255);
-		SDL_RenderClear(this->renderer);
+		if (end - begin <= grain) {
+			if (begin != end)
+				function(begin, end);
+			return;
+		}
+
+		job_counter counter;
+		for (size_t first = begin; first < end; first += grain)
+			this->run(&invoke<Function>, (void*)&function, first, min(first + grain, end), &counter);
+		this->wait(&counter);
 	}
 
-	SDL_Window* window;
-	SDL_Renderer* renderer;
+private:
+	struct worker_data
+	{
+		job_system* jobs;
+		int index;
+		SDL_sem* started;
+	};
 
-	int width, height;
+	template<typename Function>
+	static void invoke(void* context, size_t begin, size_t end)
+	{
+		(*(const Function*)context)(begin, end);
+	}
+	template<typename Function>
+	static void invoke_task(void* context, size_t, size_t)
+	{
+		Function* function = (Function*)context;
+		(*function)();
+		delete function;
+	}
+
+	static int worker_main(void* ptr)
+	{
+		worker_data* worker = (worker_data*)ptr;
+		job_system* jobs = worker->jobs;
+		jobs->thread_ids_[worker->index] = SDL_ThreadID();
+		SDL_SemPost(worker->started);
+
+		while (!SDL_AtomicGet(&jobs->quit_)) {
+			job found;
+			if (jobs->find(worker->index, &found))
+				jobs->execute(found);
+			else
+				SDL_SemWaitTimeout(jobs->wake_, 10);
+		}
+		return 0;
+	}
+
+	int current_index() const noexcept
+	{
+		SDL_threadID id = SDL_ThreadID();
+		for (int i = 1; i <= this->worker_count_; i++)
+			if (this->thread_ids_[i] == id)
+				return i;
+		return 0;
+	}
+
+	void push(const job& to_push)
+	{
+		if (!this->deques_[this->current_index()].push(to_push)) {
+			this->execute(to_push);
+			return;
+		}
+		if (SDL_SemValue(this->wake_) < (Uint32)this->worker_count_)
+			SDL_SemPost(this->wake_);
+	}
+	bool find(int index, job* found)
+	{
+		if (this->deques_[index].pop(found))
+			return true;
+
+		for (int i = 1; i <= this->worker_count_; i++)
+			if (this->deques_[(index + i) % (this->worker_count_ + 1)].steal(found))
+				return true;
+
+		return false;
+	}
+	void execute(const job& to_execute)
+	{
+		to_execute.function(to_execute.context, to_execute.begin, to_execute.end);
+
+		job_counter* counter = to_execute.counter;
+		if (!counter)
+			return;
+
+		SDL_AtomicLock(&counter->lock);
+		dynamic_array<job> ready;
+		if (SDL_AtomicAdd(&counter->pending, -1) == 1)
+			ready = move(counter->continuations);
+		SDL_AtomicUnlock(&counter->lock);
+
+		for (const job& continuation : ready)
+			this->push(continuation);
+	}
+
+	int worker_count_;
+	job_deque* deques_;
+	SDL_Thread** threads_;
+	SDL_threadID* thread_ids_;
+	worker_data* workers_;
+	SDL_sem* wake_;
+	SDL_atomic_t quit_;
 };
 
-struct font_type
+template<typename Type, size_t Capacity>
+class spsc_queue
 {
-	font_type(const char* bmp_file_path, SDL_Renderer* renderer)
+public:
+	spsc_queue() noexcept
 	{
-		SDL_Surface* surface = SDL_LoadBMP(bmp_file_path);
-		if (surface == NULL) {
-			printf("SDL_LoadBMP(%s) error: %s\n", bmp_file_path, SDL_GetError());
-			throw EXIT_FAILURE;
-		};
-		SDL_SetColorKey(surface, true, 0x000000);
+		this->reset();
+	}
+
+	spsc_queue(const spsc_queue&) = delete;
+	spsc_queue& operator=(const spsc_queue&) = delete;
+
+	void reset() noexcept
+	{
+		SDL_AtomicSet(&this->head_, 0);
+		SDL_AtomicSet(&this->tail_, 0);
+	}
 
-		this->charset = SDL_CreateTextureFromSurface(renderer, surface);
+	Type* write_slot() noexcept
+	{
+		unsigned int tail = (unsigned int)SDL_AtomicGet(&this->tail_);
+		if (tail - (unsigned int)SDL_AtomicGet(&this->head_) == Capacity)
+			return nullptr;
+		return &this->items_[tail % Capacity];
 	}
-	~font_type() noexcept
+	void push() noexcept
 	{
-		SDL_DestroyTexture(this->charset);
+		SDL_AtomicAdd(&this->tail_, 1);
 	}
 
-	font_type(const font_type&) = delete;
-	font_type(font_type&&) = delete;
-	font_type& operator=(const font_type&) = delete;
-	font_type& operator=(font_type&&) = delete;
+	Type* front() noexcept
+	{
+		unsigned int head = (unsigned int)SDL_AtomicGet(&this->head_);
+		if (head == (unsigned int)SDL_AtomicGet(&this->tail_))
+			return nullptr;
+		return &this->items_[head % Capacity];
+	}
+	void pop() noexcept
+	{
+		SDL_AtomicAdd(&this->head_, 1);
+	}
 
-	SDL_Texture* charset;
+private:
+	Type items_[Capacity];
+	SDL_atomic_t head_;
+	SDL_atomic_t tail_;
 };
-struct texture_type
+
+template<typename Type>
+class triple_buffer
 {
-	texture_type(const char* bmp_file_path, SDL_Renderer* renderer)
+public:
+	triple_buffer()
+		:mutex_(SDL_CreateMutex()), cond_(SDL_CreateCond())
 	{
-		SDL_Surface* bmp_surface = SDL_LoadBMP(bmp_file_path);
-		if (bmp_surface == NULL) {
-			printf("SDL_LoadBMP(%s) error: %s\n", bmp_file_path, SDL_GetError());
-			throw EXIT_FAILURE;
-		};
-		SDL_Surface* surface = SDL_ConvertSurfaceFormat(bmp_surface, SDL_PIXELFORMAT_RGBA8888, 0);
-
-		for (int y = 0; y < surface->h; y++)
-			for (int x = 0; x < surface->w; x++) {
-				Uint32* p = (Uint32*)((Uint8*)surface->pixels + y * surface->pitch + 
-									  x * surface->format->BytesPerPixel);
-				if (*p == 0xffffffff)
-					*p = 0x00000000;
-			}
+	}
+	~triple_buffer() noexcept
+	{
+		SDL_DestroyCond(this->cond_);
+		SDL_DestroyMutex(this->mutex_);
+	}
 
-		this->texture = SDL_CreateTextureFromSurface(renderer, surface);
-		SDL_SetTextureBlendMode(this->texture, SDL_BLENDMODE_BLEND);
-		
-		this->width = surface->w;
-		this->height = surface->h;
+	triple_buffer(const triple_buffer&) = delete;
+	triple_buffer& operator=(const triple_buffer&) = delete;
 
-		SDL_FreeSurface(bmp_surface);
-		SDL_FreeSurface(surface);
+	Type& write_buffer() noexcept
+	{
+		return this->buffers_[this->write_];
+	}
+	void publish()
+	{
+		SDL_LockMutex(this->mutex_);
+		int ready = this->ready_;
+		this->ready_ = this->write_;
+		this->write_ = ready;
+		this->fresh_ = true;
+		SDL_CondSignal(this->cond_);
+		SDL_UnlockMutex(this->mutex_);
 	}
 
-	~texture_type() noexcept
+	const Type* acquire()
+	{
+		SDL_LockMutex(this->mutex_);
+		while (!this->fresh_ && !this->closed_)
+			SDL_CondWait(this->cond_, this->mutex_);
+
+		const Type* result = nullptr;
+		if (!this->closed_) {
+			int ready = this->ready_;
+			this->ready_ = this->read_;
+			this->read_ = ready;
+			this->fresh_ = false;
+			result = &this->buffers_[this->read_];
+		}
+		SDL_UnlockMutex(this->mutex_);
+		return result;
+	}
+	void close()
 	{
-		SDL_DestroyTexture(this->texture);
+		SDL_LockMutex(this->mutex_);
+		this->closed_ = true;
+		SDL_CondSignal(this->cond_);
+		SDL_UnlockMutex(this->mutex_);
 	}
 
-	texture_type(const texture_type&) = delete;
-	texture_type(texture_type&&) = delete;
-	texture_type& operator=(const texture_type&) = delete;
-	texture_type& operator=(texture_type&&) = delete;
+private:
+	Type buffers_[3];
+	int write_ = 0;
+	int ready_ = 1;
+	int read_ = 2;
+	bool fresh_ = false;
+	bool closed_ = false;
 
-	SDL_Texture* texture;
-	int width, height;
+	SDL_mutex* mutex_;
+	SDL_cond* cond_;
 };
 
+class frame_scheduler
+{
+public:
+	frame_scheduler(float target_rate)
+		:frequency_(SDL_GetPerformanceFrequency())
+	{
+		this->spin_threshold_ = this->frequency_ * spin_threshold_ms / 1000;
+		this->set_target_rate(target_rate);
+		this->next_deadline_ = SDL_GetPerformanceCounter() + this->period_;
+		this->report_time_ = SDL_GetPerformanceCounter() + this->frequency_ * report_interval;
+	}
 
-void draw_rect(screen_type* screen, point pos, point size, color c)
+	void set_target_rate(float target_rate)
+	{
+		Uint64 period = (Uint64)(this->frequency_ / target_rate);
+		if (period == this->period_)
+			return;
+
+		this->period_ = period;
+		this->next_deadline_ = SDL_GetPerformanceCounter() + this->period_;
+	}
+
+	void wait()
+	{
+		this->frames_++;
+		Uint64 now = SDL_GetPerformanceCounter();
+
+		if (now > this->next_deadline_ + this->period_ / 8) {
+			this->missed_++;
+			this->next_deadline_ = now + this->period_;
+		}
+		else {
+			while (this->next_deadline_ > now + this->spin_threshold_) {
+				SDL_Delay((Uint32)((this->next_deadline_ - now - this->spin_threshold_) * 1000 / this->frequency_) + 1);
+				now = SDL_GetPerformanceCounter();
+			}
+			while (this->next_deadline_ > now)
+				now = SDL_GetPerformanceCounter();
+
+			this->next_deadline_ += this->period_;
+		}
+
+		if (now >= this->report_time_) {
+			if (this->missed_ != 0)
+				printf("Frame scheduler: %lu of %lu frames missed their deadline.\n", this->missed_, this->frames_);
+			this->missed_ = 0;
+			this->frames_ = 0;
+			this->report_time_ = now + this->frequency_ * report_interval;
+		}
+	}
+
+private:
+	static constexpr Uint64 spin_threshold_ms = 2;
+	static constexpr Uint64 report_interval = 10;
+
+	Uint64 frequency_;
+	Uint64 period_ = 0;
+	Uint64 spin_threshold_;
+	Uint64 next_deadline_;
+	Uint64 report_time_;
+	unsigned long missed_ = 0;
+	unsigned long frames_ = 0;
+};
+
+class rect_batcher
 {
-	SDL_Rect rect = { pos.x, pos.y, size.x, size.y };
-	SDL_SetRenderDrawColor(screen->renderer, c.r, c.g, c.b, c.a);
-	SDL_RenderFillRect(screen->renderer, &rect);
+public:
+	void add(const SDL_Rect& rect, color c, SDL_Renderer* renderer)
+	{
+		if (rect.w <= 0 || rect.h <= 0)
+			return;
+
+		int i = 0;
+		while (i < this->count_ && !(this->batches_[i].c.r == c.r && this->batches_[i].c.g == c.g &&
+									 this->batches_[i].c.b == c.b && this->batches_[i].c.a == c.a))
+			i++;
+
+		for (int j = i + 1; j < this->count_; j++)
+			if (SDL_HasIntersection(&rect, &this->batches_[j].bounds)) {
+				this->flush(renderer);
+				i = 0;
+				break;
+			}
+
+		if (i == this->count_) {
+			if (this->count_ == max_colors) {
+				this->flush(renderer);
+				i = 0;
+			}
+			this->batches_[i].c = c;
+			this->batches_[i].bounds = rect;
+			this->count_ = i + 1;
+		}
+		else
+			SDL_UnionRect(&this->batches_[i].bounds, &rect, &this->batches_[i].bounds);
+
+		this->batches_[i].rects.add(rect);
+	}
+
+	void flush(SDL_Renderer* renderer)
+	{
+		for (int i = 0; i < this->count_; i++) {
+			batch& b = this->batches_[i];
+			SDL_SetRenderDrawColor(renderer, b.c.r, b.c.g, b.c.b, b.c.a);
+			SDL_RenderFillRects(renderer, b.rects.begin(), (int)b.rects.size());
+			b.rects.clear();
+		}
+		this->count_ = 0;
+	}
+
+private:
+	static constexpr int max_colors = 8;
+
+	struct batch
+	{
+		color c;
+		SDL_Rect bounds;
+		dynamic_array<SDL_Rect> rects;
+	};
+
+	batch batches_[max_colors];
+	int count_ = 0;
+};
+
+inline Uint32 blend_pixel(Uint32 src, Uint32 dst) noexcept
+{
+	Uint32 a = src & 0xff, result = 0xff;
+	for (int shift = 8; shift < 32; shift += 8) {
+		Uint32 x = ((src >> shift) & 0xff) * a + ((dst >> shift) & 0xff) * (255 - a) + 128;
+		result |= ((x + (x >> 8)) >> 8) << shift;
+	}
+	return result;
 }
-void draw_texture(screen_type* screen, const texture_type* texture, point center)
+
+#if defined(SIMD_AVX2)
+inline __m256i blend_pixels(__m256i src, __m256i dst) noexcept
 {
-	SDL_Rect rect = { center.x - texture->width / 2, center.y - texture->height / 2,
-		texture->width, texture->height };
+	__m256i zero = _mm256_setzero_si256();
+	__m256i opaque = _mm256_set1_epi16(255);
+	__m256i bias = _mm256_set1_epi16(128);
+
+	__m256i s_lo = _mm256_unpacklo_epi8(src, zero), s_hi = _mm256_unpackhi_epi8(src, zero);
+	__m256i d_lo = _mm256_unpacklo_epi8(dst, zero), d_hi = _mm256_unpackhi_epi8(dst, zero);
+	__m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0), 0);
+	__m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0), 0);
 
-	SDL_RenderCopy(screen->renderer, texture->texture, NULL, &rect);
+	__m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s_lo, a_lo),
+												   _mm256_mullo_epi16(d_lo, _mm256_sub_epi16(opaque, a_lo))), bias);
+	__m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s_hi, a_hi),
+												   _mm256_mullo_epi16(d_hi, _mm256_sub_epi16(opaque, a_hi))), bias);
+	lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+	hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+
+	return _mm256_or_si256(_mm256_packus_epi16(lo, hi), _mm256_set1_epi32(0xff));
 }
-void draw_texture(screen_type* screen, const texture_type* texture, point center, float angle)
+#elif defined(SIMD_SSE2)
+inline __m128i blend_pixels(__m128i src, __m128i dst) noexcept
 {
-	SDL_Point point = { texture->width / 2, texture->height / 2 };
-	SDL_Rect rect = { center.x - texture->width / 2, center.y - texture->height / 2,
-		texture->width, texture->height };
+	__m128i zero = _mm_setzero_si128();
+	__m128i opaque = _mm_set1_epi16(255);
+	__m128i bias = _mm_set1_epi16(128);
 
-	SDL_RenderCopyEx(screen->renderer, texture->texture, NULL, &rect, angle, &point, SDL_FLIP_NONE);
+	__m128i s_lo = _mm_unpacklo_epi8(src, zero), s_hi = _mm_unpackhi_epi8(src, zero);
+	__m128i d_lo = _mm_unpacklo_epi8(dst, zero), d_hi = _mm_unpackhi_epi8(dst, zero);
+	__m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0), 0);
+	__m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0), 0);
+
+	__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_lo, a_lo),
+											 _mm_mullo_epi16(d_lo, _mm_sub_epi16(opaque, a_lo))), bias);
+	__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s_hi, a_hi),
+											 _mm_mullo_epi16(d_hi, _mm_sub_epi16(opaque, a_hi))), bias);
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+	return _mm_or_si128(_mm_packus_epi16(lo, hi), _mm_set1_epi32(0xff));
+}
+#endif
+
+inline void fill_span(Uint32* dst, Uint32 value, int count) noexcept
+{
+	int i = 0;
+
+#if defined(SIMD_AVX2)
+	__m256i values = _mm256_set1_epi32((int)value);
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_si256((__m256i*)(dst + i), values);
+#elif defined(SIMD_SSE2)
+	__m128i values = _mm_set1_epi32((int)value);
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(dst + i), values);
+#endif
+
+	for (; i < count; i++)
+		dst[i] = value;
+}
+inline void blend_fill_span(Uint32* dst, Uint32 value, int count) noexcept
+{
+	int i = 0;
+
+#if defined(SIMD_AVX2)
+	__m256i values = _mm256_set1_epi32((int)value);
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_si256((__m256i*)(dst + i), blend_pixels(values, _mm256_loadu_si256((const __m256i*)(dst + i))));
+#elif defined(SIMD_SSE2)
+	__m128i values = _mm_set1_epi32((int)value);
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(dst + i), blend_pixels(values, _mm_loadu_si128((const __m128i*)(dst + i))));
+#endif
+
+	for (; i < count; i++)
+		dst[i] = blend_pixel(value, dst[i]);
+}
+inline void blend_span(Uint32* dst, const Uint32* src, int count) noexcept
+{
+	int i = 0;
+
+#if defined(SIMD_AVX2)
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_si256((__m256i*)(dst + i), blend_pixels(_mm256_loadu_si256((const __m256i*)(src + i)),
+															  _mm256_loadu_si256((const __m256i*)(dst + i))));
+#elif defined(SIMD_SSE2)
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i*)(dst + i), blend_pixels(_mm_loadu_si128((const __m128i*)(src + i)),
+														   _mm_loadu_si128((const __m128i*)(dst + i))));
+#endif
+
+	for (; i < count; i++)
+		dst[i] = blend_pixel(src[i], dst[i]);
+}
+
+inline void color_key_span(Uint32* row, Uint32 key, int count) noexcept
+{
+	int i = 0;
+
+#if defined(SIMD_AVX2)
+	__m256i keys = _mm256_set1_epi32((int)key);
+	for (; i + 8 <= count; i += 8) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i*)(row + i));
+		_mm256_storeu_si256((__m256i*)(row + i), _mm256_andnot_si256(_mm256_cmpeq_epi32(pixels, keys), pixels));
+	}
+#elif defined(SIMD_SSE2)
+	__m128i keys = _mm_set1_epi32((int)key);
+	for (; i + 4 <= count; i += 4) {
+		__m128i pixels = _mm_loadu_si128((const __m128i*)(row + i));
+		_mm_storeu_si128((__m128i*)(row + i), _mm_andnot_si128(_mm_cmpeq_epi32(pixels, keys), pixels));
+	}
+#endif
+
+	for (; i < count; i++)
+		if (row[i] == key)
+			row[i] = 0x00000000;
+}
+
+class software_renderer
+{
+public:
+	software_renderer(int width, int height)
+		:pixels_((size_t)width * height), width_(width), height_(height),
+		 tiles_x_((width + tile_size - 1) / tile_size), tiles_y_((height + tile_size - 1) / tile_size),
+		 touched_((size_t)tiles_x_ * tiles_y_), hashes_((size_t)tiles_x_ * tiles_y_)
+	{
+		this->clear(color::black());
+		this->invalidate();
+	}
+
+	software_renderer(const software_renderer&) = delete;
+	software_renderer& operator=(const software_renderer&) = delete;
+
+	const Uint32* pixels() const noexcept
+	{
+		return this->pixels_.begin();
+	}
+	int pitch() const noexcept
+	{
+		return this->width_ * (int)sizeof(Uint32);
+	}
+
+	void clear(color c)
+	{
+		fill_span(this->pixels_.begin(), pack(c), this->width_ * this->height_);
+		this->mark({ 0, 0, this->width_, this->height_ });
+	}
+	void invalidate()
+	{
+		for (size_t i = 0; i < this->touched_.size(); i++) {
+			this->touched_[i] |= touched_now;
+			this->hashes_[i] = 0;
+		}
+	}
+
+	template<typename Function>
+	int present_dirty(Function update)
+	{
+		int updated = 0;
+		for (int ty = 0; ty < this->tiles_y_; ty++) {
+			int first = -1;
+			for (int tx = 0; tx <= this->tiles_x_; tx++) {
+				bool changed = false;
+				if (tx < this->tiles_x_) {
+					Uint8& touched = this->touched_[(size_t)ty * this->tiles_x_ + tx];
+					if (touched != 0) {
+						unsigned hash = this->hash_tile(tx, ty);
+						unsigned& previous = this->hashes_[(size_t)ty * this->tiles_x_ + tx];
+						changed = hash != previous;
+						previous = hash;
+					}
+				}
+
+				if (changed && first < 0)
+					first = tx;
+				else if (!changed && first >= 0) {
+					SDL_Rect rect = { first * tile_size, ty * tile_size, 0, min(tile_size, this->height_ - ty * tile_size) };
+					rect.w = min(tx * tile_size, this->width_) - rect.x;
+					update(rect, this->pixels_.begin() + (size_t)rect.y * this->width_ + rect.x, this->pitch());
+					updated++;
+					first = -1;
+				}
+			}
+		}
+
+		Uint32 black = pack(color::black());
+		for (int ty = 0; ty < this->tiles_y_; ty++)
+			for (int tx = 0; tx < this->tiles_x_; tx++) {
+				Uint8& touched = this->touched_[(size_t)ty * this->tiles_x_ + tx];
+				if (touched & touched_now) {
+					int w = min(tile_size, this->width_ - tx * tile_size);
+					int h = min(tile_size, this->height_ - ty * tile_size);
+					for (int y = 0; y < h; y++)
+						fill_span(this->pixels_.begin() + (size_t)(ty * tile_size + y) * this->width_ + tx * tile_size, black, w);
+				}
+				touched = (touched & touched_now) ? touched_before : 0;
+			}
+		return updated;
+	}
+
+	void fill_rect(SDL_Rect rect, color c)
+	{
+		if (c.a == 0 || !this->clip(&rect))
+			return;
+		this->mark(rect);
+
+		Uint32 value = pack(c);
+		for (int y = rect.y; y < rect.y + rect.h; y++) {
+			Uint32* row = this->pixels_.begin() + (size_t)y * this->width_ + rect.x;
+			if (c.a == 255)
+				fill_span(row, value, rect.w);
+			else
+				blend_fill_span(row, value, rect.w);
+		}
+	}
+
+	void copy(const SDL_Surface* source, const SDL_Rect& source_rect, SDL_Rect target)
+	{
+		SDL_Rect clipped = target;
+		if (!this->clip(&clipped))
+			return;
+		this->mark(clipped);
+
+		int sx = source_rect.x + clipped.x - target.x;
+		int sy = source_rect.y + clipped.y - target.y;
+		for (int y = 0; y < clipped.h; y++)
+			blend_span(this->pixels_.begin() + (size_t)(clipped.y + y) * this->width_ + clipped.x,
+					   (const Uint32*)((const Uint8*)source->pixels + (sy + y) * source->pitch) + sx, clipped.w);
+	}
+
+	void copy_rotated(const SDL_Surface* source, const SDL_Rect& source_rect, point center, float angle)
+	{
+		float radians = angle * (float)M_PI / 180.f;
+		float c = cosf(radians), s = sinf(radians);
+		int half_w = (int)ceilf((fabsf(source_rect.w * c) + fabsf(source_rect.h * s)) / 2.f);
+		int half_h = (int)ceilf((fabsf(source_rect.w * s) + fabsf(source_rect.h * c)) / 2.f);
+
+		SDL_Rect bounds = { center.x - half_w, center.y - half_h, 2 * half_w, 2 * half_h };
+		if (!this->clip(&bounds))
+			return;
+		this->mark(bounds);
+
+		for (int y = bounds.y; y < bounds.y + bounds.h; y++) {
+			Uint32* row = this->pixels_.begin() + (size_t)y * this->width_;
+			float dy = y + 0.5f - center.y;
+			for (int x = bounds.x; x < bounds.x + bounds.w; x++) {
+				float dx = x + 0.5f - center.x;
+				int tx = (int)floorf(dx * c + dy * s + source_rect.w / 2.f);
+				int ty = (int)floorf(-dx * s + dy * c + source_rect.h / 2.f);
+				if (tx < 0 || tx >= source_rect.w || ty < 0 || ty >= source_rect.h)
+					continue;
+
+				Uint32 texel = *((const Uint32*)((const Uint8*)source->pixels + (source_rect.y + ty) * source->pitch) + 
+								 source_rect.x + tx);
+				row[x] = blend_pixel(texel, row[x]);
+			}
+		}
+	}
+
+private:
+	static Uint32 pack(color c) noexcept
+	{
+		return (Uint32)c.r << 24 | (Uint32)c.g << 16 | (Uint32)c.b << 8 | c.a;
+	}
+	bool clip(SDL_Rect* rect) const
+	{
+		SDL_Rect bounds = { 0, 0, this->width_, this->height_ };
+		return SDL_IntersectRect(rect, &bounds, rect) == SDL_TRUE;
+	}
+	void mark(const SDL_Rect& rect)
+	{
+		for (int ty = rect.y / tile_size; ty <= (rect.y + rect.h - 1) / tile_size; ty++)
+			for (int tx = rect.x / tile_size; tx <= (rect.x + rect.w - 1) / tile_size; tx++)
+				this->touched_[(size_t)ty * this->tiles_x_ + tx] |= touched_now;
+	}
+	unsigned hash_tile(int tx, int ty) const
+	{
+		int w = min(tile_size, this->width_ - tx * tile_size);
+		int h = min(tile_size, this->height_ - ty * tile_size);
+		unsigned lanes[4] = { 2166136261u, 2166136261u ^ 1u, 2166136261u ^ 2u, 2166136261u ^ 3u };
+
+		for (int y = 0; y < h; y++) {
+			const Uint32* row = this->pixels_.begin() + (size_t)(ty * tile_size + y) * this->width_ + tx * tile_size;
+			int x = 0;
+			for (; x + 4 <= w; x += 4)
+				for (int lane = 0; lane < 4; lane++)
+					lanes[lane] = (lanes[lane] ^ row[x + lane]) * 16777619u;
+			for (; x < w; x++)
+				lanes[0] = (lanes[0] ^ row[x]) * 16777619u;
+		}
+		return hash_uint(lanes[0] ^ hash_uint(lanes[1] ^ hash_uint(lanes[2] ^ hash_uint(lanes[3])))) | 1u;
+	}
+
+	static constexpr int tile_size = 32;
+	static constexpr Uint8 touched_now = 1;
+	static constexpr Uint8 touched_before = 2;
+
+	dynamic_array<Uint32> pixels_;
+	int width_, height_;
+	int tiles_x_, tiles_y_;
+	dynamic_array<Uint8> touched_;
+	dynamic_array<unsigned> hashes_;
+};
+
+struct screen_type
+{
+	screen_type(const char* title, int width, int height, bool vsync, bool software_rendering = false, bool offscreen = false)
+		:width(width), height(height), vsync(vsync), software_rendering(software_rendering || offscreen), offscreen(offscreen)
+	{
+		if (SDL_Init(offscreen ? SDL_INIT_TIMER | SDL_INIT_EVENTS : SDL_INIT_EVERYTHING) != 0) {
+			printf("SDL_Init error: %s.\n", SDL_GetError());
+			throw EXIT_FAILURE;
+		}
+		if (offscreen)
+			return;
+
+		this->window = SDL_CreateWindow(title, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 
+										this->width, this->height, 0);
+		if (this->window == NULL) {
+			SDL_Quit();
+			printf("SDL_CreateWindow error: %s.\n", SDL_GetError());
+			throw EXIT_FAILURE;
+		}
+	}
+	~screen_type() noexcept
+	{
+		if (this->window)
+			SDL_DestroyWindow(this->window);
+
+		SDL_Quit();
+	}
+
+	screen_type(const screen_type&) = delete;
+	screen_type(screen_type&&) = delete;
+	screen_type& operator=(const screen_type&) = delete;
+	screen_type& operator=(screen_type&&) = delete;
+
+	void create_renderer()
+	{
+		if (this->software_rendering)
+			this->software = new software_renderer(this->width, this->height);
+		if (this->offscreen)
+			return;
+
+		SDL_SetHint(SDL_HINT_RENDER_BATCHING, "1");
+		this->renderer = SDL_CreateRenderer(this->window, -1, this->vsync ? SDL_RENDERER_PRESENTVSYNC : 0);
+		if (this->renderer == NULL) {
+			printf("SDL_CreateRenderer error: %s.\n", SDL_GetError());
+			throw EXIT_FAILURE;
+		};
+
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+		SDL_RenderSetLogicalSize(this->renderer, this->width, this->height);
+		SDL_SetRenderDrawBlendMode(this->renderer, SDL_BLENDMODE_BLEND);
+
+		if (this->software.get()) {
+			this->framebuffer = SDL_CreateTexture(this->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
+												  this->width, this->height);
+			if (this->framebuffer == NULL) {
+				printf("SDL_CreateTexture error: %s.\n", SDL_GetError());
+				throw EXIT_FAILURE;
+			}
+		}
+	}
+	void destroy_renderer() noexcept
+	{
+		this->software.reset();
+		if (this->framebuffer) {
+			SDL_DestroyTexture(this->framebuffer);
+			this->framebuffer = NULL;
+		}
+		if (this->renderer) {
+			SDL_DestroyRenderer(this->renderer);
+			this->renderer = NULL;
+		}
+	}
+
+	bool targets_supported() const
+	{
+		return !this->software.get() && SDL_RenderTargetSupported(this->renderer);
+	}
+
+	void update()
+	{
+		if (this->software.get()) {
+			if (SDL_AtomicSet(&this->exposed, 0) != 0)
+				this->software->invalidate();
+
+			int updated = this->software->present_dirty([this](const SDL_Rect& rect, const Uint32* pixels, int pitch) {
+				if (this->renderer)
+					SDL_UpdateTexture(this->framebuffer, &rect, pixels, pitch);
+			});
+			if (this->renderer && updated != 0) {
+				SDL_RenderCopy(this->renderer, this->framebuffer, NULL, NULL);
+				SDL_RenderPresent(this->renderer);
+			}
+			return;
+		}
+
+		this->rects.flush(this->renderer);
+		SDL_RenderPresent(this->renderer);
+		SDL_SetRenderDrawColor(this->renderer, 0, 0, 0, 255);
+		SDL_RenderClear(this->renderer);
+	}
+
+	SDL_Window* window = NULL;
+	SDL_Renderer* renderer = NULL;
+	rect_batcher rects;
+	unique_ptr<software_renderer> software;
+	SDL_Texture* framebuffer = NULL;
+	SDL_atomic_t exposed = {};
+	SDL_atomic_t targets_reset = {};
+	SDL_atomic_t size_changed = {};
+
+	int width, height;
+	bool vsync;
+	bool software_rendering;
+	bool offscreen;
+};
+
+SDL_Surface* load_surface(const char* bmp_file_path, Uint32 transparent)
+{
+	SDL_Surface* bmp_surface = SDL_LoadBMP(bmp_file_path);
+	if (bmp_surface == NULL) {
+		printf("SDL_LoadBMP(%s) error: %s\n", bmp_file_path, SDL_GetError());
+		throw EXIT_FAILURE;
+	};
+	SDL_Surface* surface = SDL_ConvertSurfaceFormat(bmp_surface, SDL_PIXELFORMAT_RGBA8888, 0);
+	SDL_FreeSurface(bmp_surface);
+
+	for (int y = 0; y < surface->h; y++)
+		color_key_span((Uint32*)((Uint8*)surface->pixels + y * surface->pitch), transparent, surface->w);
+
+	return surface;
+}
+SDL_Surface* rotate_surface(SDL_Surface* source, float angle)
+{
+	float radians = angle * (float)M_PI / 180.f;
+	float c = cosf(radians), s = sinf(radians);
+	int width = (int)ceilf(fabsf(source->w * c) + fabsf(source->h * s));
+	int height = (int)ceilf(fabsf(source->w * s) + fabsf(source->h * c));
+
+	SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_RGBA8888);
+	if (surface == NULL) {
+		printf("SDL_CreateRGBSurfaceWithFormat error: %s\n", SDL_GetError());
+		throw EXIT_FAILURE;
+	}
+
+	for (int y = 0; y < height; y++) {
+		Uint32* p = (Uint32*)((Uint8*)surface->pixels + y * surface->pitch);
+		float dy = y + 0.5f - height / 2.f;
+		for (int x = 0; x < width; x++) {
+			float dx = x + 0.5f - width / 2.f;
+			int sx = (int)floorf(dx * c + dy * s + source->w / 2.f);
+			int sy = (int)floorf(-dx * s + dy * c + source->h / 2.f);
+
+			p[x] = sx >= 0 && sx < source->w && sy >= 0 && sy < source->h ?
+				*(Uint32*)((Uint8*)source->pixels + sy * source->pitch + sx * 4) : 0x00000000;
+		}
+	}
+
+	return surface;
+}
+
+class asset_pack
+{
+public:
+	static constexpr char magic[8] = "SHPACK3";
+
+	static bool write(const char* path, SDL_Surface** surfaces, int count)
+	{
+		FILE* file;
+		fopen_s(&file, path, "wb");
+		if (!file)
+			return false;
+
+		Uint64 offset = align(header_size + (Uint64)count * sizeof(entry));
+		dynamic_array<entry> entries((size_t)count);
+		for (int i = 0; i < count; i++) {
+			entries[i] = { (Uint32)surfaces[i]->w, (Uint32)surfaces[i]->h, offset };
+			offset = align(offset + (Uint64)surfaces[i]->w * surfaces[i]->h * sizeof(Uint32));
+		}
+
+		Uint32 entries_count = (Uint32)count;
+		fwrite(magic, sizeof(magic), 1, file);
+		fwrite(&entries_count, sizeof(entries_count), 1, file);
+		fwrite(entries.begin(), sizeof(entry), count, file);
+
+		static const Uint8 padding[alignment] = {};
+		Uint64 position = header_size + (Uint64)count * sizeof(entry);
+		for (int i = 0; i < count; i++) {
+			fwrite(padding, 1, (size_t)(entries[i].offset - position), file);
+			for (int y = 0; y < surfaces[i]->h; y++)
+				fwrite((Uint8*)surfaces[i]->pixels + y * surfaces[i]->pitch, sizeof(Uint32), surfaces[i]->w, file);
+			position = entries[i].offset + (Uint64)surfaces[i]->w * surfaces[i]->h * sizeof(Uint32);
+		}
+
+		fclose(file);
+		return true;
+	}
+
+	bool load(const char* path)
+	{
+		FILE* file;
+		fopen_s(&file, path, "rb");
+		if (!file)
+			return false;
+
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+
+		this->data_.resize(size > 0 ? (size_t)size : 0);
+		bool read = size > 0 && fread(this->data_.begin(), 1, (size_t)size, file) == (size_t)size;
+		fclose(file);
+
+		Uint64 size64 = this->data_.size();
+		if (!read || size64 < header_size || memcmp(this->data_.begin(), magic, sizeof(magic)) != 0)
+			return false;
+
+		memcpy(&this->count_, this->data_.begin() + sizeof(magic), sizeof(this->count_));
+		if (size64 < header_size + (Uint64)this->count_ * sizeof(entry))
+			return false;
+
+		for (Uint32 i = 0; i < this->count_; i++) {
+			entry e = this->get_entry(i);
+			if (e.offset > size64 || (Uint64)e.width * e.height * sizeof(Uint32) > size64 - e.offset)
+				return false;
+		}
+		return true;
+	}
+
+	int count() const noexcept
+	{
+		return (int)this->count_;
+	}
+
+	SDL_Surface* surface(int index)
+	{
+		if (index < 0 || (Uint32)index >= this->count_)
+			return NULL;
+
+		entry e = this->get_entry(index);
+		if (e.offset > this->data_.size() || (Uint64)e.width * e.height * sizeof(Uint32) > this->data_.size() - e.offset)
+			return NULL;
+		return SDL_CreateRGBSurfaceWithFormatFrom(this->data_.begin() + (size_t)e.offset, e.width, e.height, 32, 
+												  e.width * sizeof(Uint32), SDL_PIXELFORMAT_RGBA8888);
+	}
+
+private:
+	static constexpr Uint64 alignment = 16;
+	static constexpr Uint64 header_size = sizeof(magic) + sizeof(Uint32);
+
+	struct entry
+	{
+		Uint32 width, height;
+		Uint64 offset;
+	};
+
+	static Uint64 align(Uint64 offset) noexcept
+	{
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+	entry get_entry(Uint32 index) const
+	{
+		entry e;
+		memcpy(&e, this->data_.begin() + (size_t)header_size + index * sizeof(entry), sizeof(e));
+		return e;
+	}
+
+	dynamic_array<Uint8> data_;
+	Uint32 count_ = 0;
+};
+
+struct texture_atlas
+{
+	texture_atlas(SDL_Surface** surfaces, int count, SDL_Renderer* renderer)
+		:rects(count)
+	{
+		static constexpr int padding = 2;
+
+		dynamic_array<int> order(count);
+		int width = 256;
+		float area = 0.f;
+		for (int i = 0; i < count; i++) {
+			int j = i;
+			for (; j > 0 && surfaces[order[j - 1]]->h < surfaces[i]->h; j--)
+				order[j] = order[j - 1];
+			order[j] = i;
+			width = max(width, surfaces[i]->w + 2 * padding);
+			area += (float)(surfaces[i]->w + padding) * (surfaces[i]->h + padding);
+		}
+		width = max(width, (int)ceilf(sqrtf(area)));
+
+		int x = padding, y = padding, shelf_height = 0;
+		for (int i : order) {
+			if (x + surfaces[i]->w + padding > width) {
+				x = padding;
+				y += shelf_height + padding;
+				shelf_height = 0;
+			}
+			this->rects[i] = { x, y, surfaces[i]->w, surfaces[i]->h };
+			x += surfaces[i]->w + padding;
+			shelf_height = max(shelf_height, surfaces[i]->h);
+		}
+
+		SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0, width, y + shelf_height + padding, 32, SDL_PIXELFORMAT_RGBA8888);
+		if (atlas == NULL) {
+			printf("SDL_CreateRGBSurfaceWithFormat error: %s\n", SDL_GetError());
+			throw EXIT_FAILURE;
+		}
+		SDL_FillRect(atlas, NULL, 0x00000000);
+		for (int i = 0; i < count; i++) {
+			SDL_SetSurfaceBlendMode(surfaces[i], SDL_BLENDMODE_NONE);
+			SDL_BlitSurface(surfaces[i], NULL, atlas, &this->rects[i]);
+		}
+
+		this->surface = atlas;
+		if (renderer) {
+			this->texture = SDL_CreateTextureFromSurface(renderer, atlas);
+			if (this->texture == NULL) {
+				printf("SDL_CreateTextureFromSurface error: %s\n", SDL_GetError());
+				SDL_FreeSurface(atlas);
+				throw EXIT_FAILURE;
+			}
+			SDL_SetTextureBlendMode(this->texture, SDL_BLENDMODE_BLEND);
+		}
+	}
+	~texture_atlas() noexcept
+	{
+		if (this->texture)
+			SDL_DestroyTexture(this->texture);
+		SDL_FreeSurface(this->surface);
+	}
+
+	texture_atlas(const texture_atlas&) = delete;
+	texture_atlas(texture_atlas&&) = delete;
+	texture_atlas& operator=(const texture_atlas&) = delete;
+	texture_atlas& operator=(texture_atlas&&) = delete;
+
+	SDL_Texture* texture = NULL;
+	SDL_Surface* surface;
+	dynamic_array<SDL_Rect> rects;
+};
+
+struct font_type
+{
+	SDL_Texture* charset;
+	SDL_Surface* surface;
+	SDL_Rect source;
+};
+struct texture_type
+{
+	SDL_Texture* texture;
+	SDL_Surface* surface;
+	SDL_Rect source;
+};
+
+
+void draw_rect(screen_type* screen, point pos, point size, color c)
+{
+	if (screen->software.get()) {
+		screen->software->fill_rect({ pos.x, pos.y, size.x, size.y }, c);
+		return;
+	}
+	screen->rects.add({ pos.x, pos.y, size.x, size.y }, c, screen->renderer);
+}
+void fill_rects(screen_type* screen, const SDL_Rect* rects, int count, color c)
+{
+	if (screen->software.get()) {
+		for (int i = 0; i < count; i++)
+			screen->software->fill_rect(rects[i], c);
+		return;
+	}
+	screen->rects.flush(screen->renderer);
+	SDL_SetRenderDrawColor(screen->renderer, c.r, c.g, c.b, c.a);
+	SDL_RenderFillRects(screen->renderer, rects, count);
+}
+void draw_texture(screen_type* screen, const texture_type* texture, point center)
+{
+	SDL_Rect rect = { center.x - texture->source.w / 2, center.y - texture->source.h / 2,
+		texture->source.w, texture->source.h };
+	if (screen->software.get()) {
+		screen->software->copy(texture->surface, texture->source, rect);
+		return;
+	}
+
+	screen->rects.flush(screen->renderer);
+	SDL_RenderCopy(screen->renderer, texture->texture, &texture->source, &rect);
+}
+void draw_texture(screen_type* screen, const texture_type* texture, point center, float angle)
+{
+	if (screen->software.get()) {
+		screen->software->copy_rotated(texture->surface, texture->source, center, angle);
+		return;
+	}
+
+	screen->rects.flush(screen->renderer);
+	SDL_Point point = { texture->source.w / 2, texture->source.h / 2 };
+	SDL_Rect rect = { center.x - texture->source.w / 2, center.y - texture->source.h / 2,
+		texture->source.w, texture->source.h };
+
+	SDL_RenderCopyEx(screen->renderer, texture->texture, &texture->source, &rect, angle, &point, SDL_FLIP_NONE);
 }
 
 void draw_text(screen_type* screen, const font_type* font, const char* text, point pos)
@@ -458,15 +1773,19 @@ void draw_text(screen_type* screen, const font_type* font, const char* text, poi
 	s.h = 8;
 	d.w = 8;
 	d.h = 8;
+	screen->rects.flush(screen->renderer);
 	while (*text) {
 		c = *text & 255;
-		px = (c % 16) * 8;
-		py = (c / 16) * 8;
+		px = font->source.x + (c % 16) * 8;
+		py = font->source.y + (c / 16) * 8;
 		s.x = px;
 		s.y = py;
 		d.x = pos.x;
 		d.y = pos.y;
-		SDL_RenderCopy(screen->renderer, font->charset, &s, &d);
+		if (screen->software.get())
+			screen->software->copy(font->surface, s, d);
+		else
+			SDL_RenderCopy(screen->renderer, font->charset, &s, &d);
 		pos.x += 8;
 		text++;
 	};
@@ -481,3 +1800,452 @@ void draw_text_right(screen_type* screen, const font_type* font, const char* tex
 	pos.x -= (int)strlen(text) * 8;
 	draw_text(screen, font, text, pos);
 }
+
+class text_cache
+{
+public:
+	text_cache() = default;
+	~text_cache() noexcept
+	{
+		this->clear();
+	}
+
+	text_cache(const text_cache&) = delete;
+	text_cache& operator=(const text_cache&) = delete;
+
+	void draw(screen_type* screen, const font_type* font, const char* text, point pos)
+	{
+		this->draw_aligned(screen, font, text, pos, 0);
+	}
+	void draw_center(screen_type* screen, const font_type* font, const char* text, point pos)
+	{
+		this->draw_aligned(screen, font, text, pos, 4);
+	}
+	void draw_right(screen_type* screen, const font_type* font, const char* text, point pos)
+	{
+		this->draw_aligned(screen, font, text, pos, 8);
+	}
+
+	void clear() noexcept
+	{
+		for (text_run& run : this->runs_)
+			SDL_DestroyTexture(run.texture);
+		this->runs_.clear();
+		this->bytes_ = 0;
+	}
+
+private:
+	struct text_run
+	{
+		unsigned hash = 0;
+		dynamic_array<char> text;
+		SDL_Texture* texture = NULL;
+		int width = 0;
+		unsigned long long last_used = 0;
+	};
+
+	static constexpr size_t max_runs = 128;
+
+	void draw_aligned(screen_type* screen, const font_type* font, const char* text, point pos, int offset)
+	{
+		unsigned hash = 2166136261u;
+		int length = 0;
+		for (const char* c = text; *c; ++c, ++length)
+			hash = (hash ^ (unsigned char)*c) * 16777619u;
+
+		if (length == 0)
+			return;
+		pos.x -= length * offset;
+
+		text_run* run = this->find(hash, text, length);
+		if (!run)
+			run = this->insert(screen, font, hash, text, length);
+		if (!run) {
+			draw_text(screen, font, text, pos);
+			return;
+		}
+
+		run->last_used = ++this->clock_;
+
+		screen->rects.flush(screen->renderer);
+		SDL_Rect target = { pos.x, pos.y, run->width, 8 };
+		SDL_RenderCopy(screen->renderer, run->texture, NULL, &target);
+	}
+
+	text_run* find(unsigned hash, const char* text, int length)
+	{
+		for (text_run& run : this->runs_)
+			if (run.hash == hash && run.width == length * 8 && memcmp(run.text.begin(), text, length) == 0)
+				return &run;
+
+		return nullptr;
+	}
+
+	text_run* insert(screen_type* screen, const font_type* font, unsigned hash, const char* text, int length)
+	{
+		size_t bytes = (size_t)length * 8 * 8 * 4;
+		if (bytes > this->budget_ || !screen->targets_supported())
+			return nullptr;
+
+		while (this->runs_.size() != 0 && (this->bytes_ + bytes > this->budget_ || this->runs_.size() >= max_runs))
+			this->evict();
+
+		SDL_Texture* texture = SDL_CreateTexture(screen->renderer, SDL_PIXELFORMAT_RGBA8888, 
+												 SDL_TEXTUREACCESS_TARGET, length * 8, 8);
+		if (!texture)
+			return nullptr;
+		SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+
+		screen->rects.flush(screen->renderer);
+		SDL_Texture* previous = SDL_GetRenderTarget(screen->renderer);
+		SDL_SetRenderTarget(screen->renderer, texture);
+		SDL_SetRenderDrawColor(screen->renderer, 0, 0, 0, 0);
+		SDL_RenderClear(screen->renderer);
+		draw_text(screen, font, text, { 0, 0 });
+		SDL_SetRenderTarget(screen->renderer, previous);
+
+		text_run run;
+		run.hash = hash;
+		run.text.add((char*)text, (char*)text + length);
+		run.texture = texture;
+		run.width = length * 8;
+
+		this->bytes_ += bytes;
+		this->runs_.add(move(run));
+		return &this->runs_[this->runs_.size() - 1];
+	}
+
+	void evict()
+	{
+		text_run* oldest = this->runs_.begin();
+		for (text_run& run : this->runs_)
+			if (run.last_used < oldest->last_used)
+				oldest = &run;
+
+		this->bytes_ -= (size_t)oldest->width * 8 * 4;
+		SDL_DestroyTexture(oldest->texture);
+		this->runs_.erase(oldest);
+	}
+
+	dynamic_array<text_run> runs_;
+	size_t budget_ = 1 << 20;
+	size_t bytes_ = 0;
+	unsigned long long clock_ = 0;
+};
+
+enum upscale_filter
+{
+	upscale_linear, upscale_integer
+};
+
+class dynamic_resolution
+{
+public:
+	dynamic_resolution() = default;
+	~dynamic_resolution() noexcept
+	{
+		if (this->texture_)
+			SDL_DestroyTexture(this->texture_);
+	}
+
+	dynamic_resolution(const dynamic_resolution&) = delete;
+	dynamic_resolution& operator=(const dynamic_resolution&) = delete;
+
+	void create(screen_type* screen, float min_scale, float max_scale, upscale_filter filter, float frame_rate)
+	{
+		this->budget_ = (Uint64)(SDL_GetPerformanceFrequency() / frame_rate);
+		this->min_scale_ = min_scale;
+		this->max_scale_ = max_scale;
+		this->filter_ = filter;
+		this->scale_ = filter == upscale_integer ? 1.f / ceilf(1.f / max_scale) : max_scale;
+		this->adjust_time_ = SDL_GetTicks() + adjust_interval;
+
+		if (min_scale >= 1.f || !screen->targets_supported())
+			return;
+
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, filter == upscale_integer ? "nearest" : "linear");
+		this->texture_ = SDL_CreateTexture(screen->renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+										   screen->width, screen->height);
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+		if (this->texture_)
+			SDL_SetTextureBlendMode(this->texture_, SDL_BLENDMODE_NONE);
+	}
+
+	void begin(screen_type* screen)
+	{
+		this->active_ = this->texture_ && this->scale_ < 1.f;
+		if (!this->active_)
+			return;
+
+		screen->rects.flush(screen->renderer);
+		SDL_SetRenderTarget(screen->renderer, this->texture_);
+		SDL_SetRenderDrawColor(screen->renderer, 0, 0, 0, 255);
+		SDL_RenderClear(screen->renderer);
+		SDL_RenderSetScale(screen->renderer, this->scale_, this->scale_);
+	}
+	void end(screen_type* screen)
+	{
+		if (!this->active_)
+			return;
+
+		screen->rects.flush(screen->renderer);
+		SDL_SetRenderTarget(screen->renderer, NULL);
+		SDL_Rect source = { 0, 0, (int)(screen->width * this->scale_ + 0.5f), (int)(screen->height * this->scale_ + 0.5f) };
+		SDL_RenderCopy(screen->renderer, this->texture_, &source, NULL);
+		this->active_ = false;
+	}
+
+	void measure(Uint64 work)
+	{
+		if (!this->texture_)
+			return;
+
+		this->work_ += work;
+		this->frames_++;
+		if (!SDL_TICKS_PASSED(SDL_GetTicks(), this->adjust_time_))
+			return;
+
+		Uint64 average = this->work_ / this->frames_;
+		if (average > this->budget_ + this->budget_ / 5)
+			this->step(false);
+		else if (average < this->budget_ / 2)
+			this->step(true);
+
+		this->work_ = 0;
+		this->frames_ = 0;
+		this->adjust_time_ = SDL_GetTicks() + adjust_interval;
+	}
+
+	float scale() const
+	{
+		return this->texture_ ? this->scale_ : 1.f;
+	}
+
+private:
+	static constexpr Uint32 adjust_interval = 250;
+
+	void step(bool up)
+	{
+		float scale;
+		if (this->filter_ == upscale_integer) {
+			scale = 1.f / max(roundf(1.f / this->scale_) + (up ? -1.f : 1.f), 1.f);
+			if (scale < this->min_scale_ || scale > this->max_scale_)
+				return;
+		}
+		else
+			scale = clamp(this->scale_ * (up ? 1.1f : 0.8f), this->min_scale_, this->max_scale_);
+
+		if (scale == this->scale_)
+			return;
+		printf("Renderer: scene scale %.2f -> %.2f.\n", this->scale_, scale);
+		this->scale_ = scale;
+	}
+
+	SDL_Texture* texture_ = NULL;
+	upscale_filter filter_ = upscale_linear;
+	float min_scale_ = 1.f;
+	float max_scale_ = 1.f;
+	float scale_ = 1.f;
+	bool active_ = false;
+
+	Uint64 budget_ = 0;
+	Uint64 work_ = 0;
+	unsigned long frames_ = 0;
+	Uint32 adjust_time_ = 0;
+};
+
+enum capture_format
+{
+	capture_raw_rgb, capture_y4m
+};
+
+class frame_capture
+{
+public:
+	frame_capture(const char* path, capture_format format, int width, int height, int frame_rate, bool paced)
+		:format_(format), width_(width), height_(height), frame_rate_(frame_rate), paced_(paced && format == capture_y4m)
+	{
+		if (format == capture_y4m && (width % 2 != 0 || height % 2 != 0)) {
+			printf("Y4M capture needs an even frame size, got %ix%i.\n", width, height);
+			throw EXIT_FAILURE;
+		}
+		fopen_s(&this->file_, path, "wb");
+		if (!this->file_) {
+			printf("Cannot open %s for capture.\n", path);
+			throw EXIT_FAILURE;
+		}
+		if (this->format_ == capture_y4m)
+			fprintf(this->file_, "YUV4MPEG2 W%i H%i F%i:1 Ip A1:1 C420jpeg\n", width, height, frame_rate);
+		else
+			printf("Frame capture: raw RGB output has no timing, it holds one %ix%i frame per rendered frame.\n", width, height);
+
+		for (int i = 0; i < buffers_count; i++) {
+			this->buffers_[i].resize((size_t)width * height);
+			*this->free_.write_slot() = i;
+			this->free_.push();
+		}
+		this->output_.resize(this->format_ == capture_y4m ? (size_t)width * height * 3 / 2 : (size_t)width * height * 3);
+
+		this->ready_ = SDL_CreateSemaphore(0);
+		SDL_AtomicSet(&this->quit_, 0);
+		this->thread_ = SDL_CreateThread(writer_main, "capture", this);
+	}
+	~frame_capture() noexcept
+	{
+		SDL_AtomicSet(&this->quit_, 1);
+		SDL_SemPost(this->ready_);
+		SDL_WaitThread(this->thread_, NULL);
+		SDL_DestroySemaphore(this->ready_);
+		fclose(this->file_);
+
+		printf("Frame capture: wrote %lu frames (%lu repeated, %lu skipped), dropped %lu.\n", 
+			   this->written_, this->repeated_, this->skipped_, this->dropped_);
+	}
+
+	frame_capture(const frame_capture&) = delete;
+	frame_capture& operator=(const frame_capture&) = delete;
+
+	void capture(screen_type* screen)
+	{
+		int* slot = this->free_.front();
+		if (!slot) {
+			if (this->dropping_++ == 0)
+				printf("Frame capture: writer fell behind, dropping frames.\n");
+			this->dropped_++;
+			return;
+		}
+		if (this->dropping_ != 0) {
+			printf("Frame capture: dropped %lu frames in a row.\n", this->dropping_);
+			this->dropping_ = 0;
+		}
+
+		int index = *slot;
+		this->free_.pop();
+
+		this->times_[index] = SDL_GetPerformanceCounter();
+		Uint32* pixels = this->buffers_[index].begin();
+		if (screen->software.get())
+			memcpy(pixels, screen->software->pixels(), (size_t)this->width_ * this->height_ * sizeof(Uint32));
+		else {
+			if (!this->readback_reported_) {
+				printf("Frame capture: SDL 2.0.10 has no asynchronous readback, each captured frame waits for the GPU. "
+					   "Use --software to capture without stalls.\n");
+				this->readback_reported_ = true;
+			}
+			screen->rects.flush(screen->renderer);
+			SDL_RenderReadPixels(screen->renderer, NULL, SDL_PIXELFORMAT_RGBA8888, pixels, this->width_ * (int)sizeof(Uint32));
+		}
+
+		*this->filled_.write_slot() = index;
+		this->filled_.push();
+		SDL_SemPost(this->ready_);
+	}
+
+private:
+	static constexpr int buffers_count = 8;
+
+	static int writer_main(void* ptr)
+	{
+		frame_capture* capture = (frame_capture*)ptr;
+
+		for (;;) {
+			int* slot = capture->filled_.front();
+			if (!slot) {
+				if (SDL_AtomicGet(&capture->quit_))
+					break;
+				SDL_SemWait(capture->ready_);
+				continue;
+			}
+
+			int index = *slot;
+			capture->filled_.pop();
+			capture->write(capture->buffers_[index].begin(), capture->times_[index]);
+
+			*capture->free_.write_slot() = index;
+			capture->free_.push();
+		}
+		return 0;
+	}
+
+	void write(const Uint32* pixels, Uint64 time)
+	{
+		int copies = 1;
+		if (this->paced_) {
+			if (this->written_ == 0)
+				this->start_ = time;
+			Uint64 slot = (Uint64)((double)(time - this->start_) * this->frame_rate_ / SDL_GetPerformanceFrequency() + 0.5);
+			if (slot < this->next_slot_) {
+				this->skipped_++;
+				return;
+			}
+			copies = (int)(slot - this->next_slot_ + 1);
+			this->next_slot_ = slot + 1;
+		}
+
+		Uint8* out = this->output_.begin();
+		size_t count = (size_t)this->width_ * this->height_;
+
+		if (this->format_ == capture_raw_rgb) {
+			for (size_t i = 0; i < count; i++) {
+				out[3 * i] = (Uint8)(pixels[i] >> 24);
+				out[3 * i + 1] = (Uint8)(pixels[i] >> 16);
+				out[3 * i + 2] = (Uint8)(pixels[i] >> 8);
+			}
+		}
+		else {
+			Uint8* y_plane = out;
+			Uint8* u_plane = out + count;
+			Uint8* v_plane = u_plane + count / 4;
+
+			for (size_t i = 0; i < count; i++) {
+				int r = (pixels[i] >> 24) & 0xff, g = (pixels[i] >> 16) & 0xff, b = (pixels[i] >> 8) & 0xff;
+				y_plane[i] = (Uint8)((77 * r + 150 * g + 29 * b + 128) >> 8);
+			}
+			for (int y = 0; y < this->height_ / 2; y++)
+				for (int x = 0; x < this->width_ / 2; x++) {
+					int r = 0, g = 0, b = 0;
+					for (int i = 0; i < 4; i++) {
+						Uint32 p = pixels[(size_t)(2 * y + i / 2) * this->width_ + 2 * x + i % 2];
+						r += (p >> 24) & 0xff;
+						g += (p >> 16) & 0xff;
+						b += (p >> 8) & 0xff;
+					}
+					u_plane[y * (this->width_ / 2) + x] = (Uint8)clamp(((-43 * r - 85 * g + 128 * b + 512) >> 10) + 128, 0, 255);
+					v_plane[y * (this->width_ / 2) + x] = (Uint8)clamp(((128 * r - 107 * g - 21 * b + 512) >> 10) + 128, 0, 255);
+				}
+		}
+
+		for (int i = 0; i < copies; i++) {
+			if (this->format_ == capture_y4m)
+				fputs("FRAME\n", this->file_);
+			fwrite(out, 1, this->output_.size(), this->file_);
+			this->written_++;
+		}
+		this->repeated_ += copies - 1;
+	}
+
+	capture_format format_;
+	int width_, height_;
+	int frame_rate_;
+	bool paced_;
+	FILE* file_ = NULL;
+
+	dynamic_array<Uint32> buffers_[buffers_count];
+	Uint64 times_[buffers_count] = {};
+	Uint64 start_ = 0;
+	Uint64 next_slot_ = 0;
+	dynamic_array<Uint8> output_;
+	spsc_queue<int, buffers_count> free_;
+	spsc_queue<int, buffers_count> filled_;
+
+	SDL_Thread* thread_ = NULL;
+	SDL_sem* ready_ = NULL;
+	SDL_atomic_t quit_;
+
+	unsigned long written_ = 0;
+	unsigned long repeated_ = 0;
+	unsigned long skipped_ = 0;
+	unsigned long dropped_ = 0;
+	unsigned long dropping_ = 0;
+	bool readback_reported_ = false;
+};